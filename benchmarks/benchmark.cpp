@@ -3,30 +3,410 @@
 
 #define FUTURE_TRACE 0
 #include <cps/future.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace cps;
 
+/** Every trip through the global allocator, so we can report allocations per operation */
+static std::atomic<size_t> allocations { 0 };
+
+/*
+ * We replace every form of the global operator new and delete, so that
+ * whichever one the library or the standard library picks is counted,
+ * and each pointer goes back to the allocator it came from.
+ */
+static void *counted_malloc(size_t size) noexcept {
+	++allocations;
+	return std::malloc(size ? size : 1);
+}
+
+static void *counted_new(size_t size) {
+	if(auto p = counted_malloc(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size) { return counted_new(size); }
+void *operator new[](size_t size) { return counted_new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return counted_malloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return counted_malloc(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+
+#if defined(__cpp_aligned_new)
+/* aligned_alloc wants the size to be a multiple of the alignment */
+static void *counted_aligned_malloc(size_t size, std::align_val_t align) noexcept {
+	++allocations;
+	const auto a = static_cast<size_t>(align);
+	return std::aligned_alloc(a, size ? (size + a - 1) / a * a : a);
+}
+
+static void *counted_aligned_new(size_t size, std::align_val_t align) {
+	if(auto p = counted_aligned_malloc(size, align))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) { return counted_aligned_new(size, align); }
+void *operator new[](size_t size, std::align_val_t align) { return counted_aligned_new(size, align); }
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return counted_aligned_malloc(size, align); }
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return counted_aligned_malloc(size, align); }
+
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+#endif
+
+/**
+ * Runs the given code count times, and reports average time and
+ * allocations per iteration.
+ */
+template<typename F>
+void
+measure(const std::string &name, int count, F code)
+{
+	const size_t allocations_before = allocations;
+	auto start = std::chrono::high_resolution_clock::now();
+	for(int i = 0; i < count; ++i)
+		code();
+	auto elapsed = std::chrono::high_resolution_clock::now() - start;
+	const size_t allocations_after = allocations;
+	std::cout
+		<< name << ": "
+		<< (std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (float)count)
+		<< " ns, "
+		<< ((allocations_after - allocations_before) / (float)count)
+		<< " allocations"
+		<< std::endl;
+}
+
+/**
+ * Runs the given code count times on each of several threads at once,
+ * and reports the average time per iteration on each thread.
+ */
+template<typename F>
+void
+measure_contended(const std::string &name, int threads, int count, F code)
+{
+	std::atomic<bool> go { false };
+	std::vector<std::thread> workers;
+	for(int t = 0; t < threads; ++t) {
+		workers.emplace_back([&] {
+			while(!go.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			for(int i = 0; i < count; ++i)
+				code();
+		});
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+	go = true;
+	for(auto &w : workers)
+		w.join();
+	auto elapsed = std::chrono::high_resolution_clock::now() - start;
+	std::cout
+		<< name << ", " << threads << " threads: "
+		<< (std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (float)count)
+		<< " ns"
+		<< std::endl;
+}
+
+/** Somewhere for lazy pipelines to deliver to, which the optimiser can't drop */
+static volatile int lazy_result;
+
+struct sink {
+	void set_value(int v) { lazy_result = v; }
+	void set_error(std::exception_ptr) { }
+	void set_cancelled() { }
+};
+
+#if CPS_FUTURE_HAVE_COROUTINES
+/** One link in a coroutine chain, the co_await counterpart to ->then */
+future_ptr<int> add_one(future_ptr<int> in) {
+	co_return co_await in + 1;
+}
+#endif
+
+/** Moves a completed future, which is when we need the construction lock */
+template<typename Policy>
+void
+move_future()
+{
+	auto f = future<int, Policy>::create_ptr();
+	f->done(1);
+	future<int, Policy> moved { std::move(*f) };
+}
+
 int
 main(void)
 {
-	auto start = std::chrono::high_resolution_clock::now();
+	std::cout << "Timing mode " << CPS_FUTURE_TIMING << " (0 = off, 1 = every future, N = one in N)" << std::endl;
 	std::cout << "A future<int> is " << sizeof(cps::future<int>) << " bytes, and future<string> is " << sizeof(cps::future<std::string>) << " bytes" << std::endl;
+	std::cout << "With the single_thread policy, future<int> is " << sizeof(cps::future<int, single_thread>) << " bytes" << std::endl;
 	const int count = 100000;
 	auto f2 = future<std::string>::create_shared();
-	for(int i = 0; i < count; ++i) {
+	measure("create -> on_done -> done", count, [] {
+		auto f = make_future<std::string>();
+		auto expected = "happy";
+		f->on_done([expected](const std::string &) {
+		})->done(expected);
+	});
+	measure("create -> on_done -> done (single_thread)", count, [] {
+		auto f = future<std::string, single_thread>::create_ptr();
+		auto expected = "happy";
+		f->on_done([expected](const std::string &) {
+		})->done(expected);
+	});
+	measure("create -> on_done -> done (slab_allocator)", count, [] {
+		auto f = make_future<std::string>(std::allocator_arg, slab_allocator<std::string>());
+		auto expected = "happy";
+		f->on_done([expected](const std::string &) {
+		})->done(expected);
+	});
+	measure("create -> on_done -> done (shared_ptr API)", count, [] {
 		auto f = future<std::string>::create_shared();
 		auto expected = "happy";
 		f->on_done([expected](const std::string &) {
 		})->done(expected);
+	});
+	measure("create -> on_ready -> done", count, [] {
+		make_future<std::string>()->on_ready([](future<std::string> &) {
+		})->done("happy");
+	});
+	measure("create -> on_ready -> done (single_thread)", count, [] {
+		future<std::string, single_thread>::create_ptr()->on_ready([](future<std::string, single_thread> &) {
+		})->done("happy");
+	});
+	measure("create -> on_ready -> fail", count, [] {
+		make_future<std::string>()->on_ready([](future<std::string> &) {
+		})->fail(std::runtime_error("backend unavailable"));
+	});
+	measure("create -> on_ready -> done (slab_allocator)", count, [] {
+		make_future<std::string>(std::allocator_arg, slab_allocator<std::string>())->on_ready([](future<std::string> &) {
+		})->done("happy");
+	});
+	measure("create -> on_fail -> fail (reads failure_reason)", count, [] {
+		make_future<std::string>()->on_fail([](const std::string &) {
+		})->fail(std::runtime_error("backend unavailable"));
+	});
+	measure("->then on a resolved future, returning resolved_future (cache hit)", count, [] {
+		resolved_future(std::string("cached"))->then([](const std::string &v) {
+			return resolved_future(v);
+		});
+	});
+	measure("map a value with ->then and resolved_future", count, [] {
+		auto f = make_future<int>();
+		f->then([](int v) { return resolved_future(v + 1); });
+		f->done(1);
+	});
+	measure("map a value with ->transform", count, [] {
+		auto f = make_future<int>();
+		f->transform([](int v) { return v + 1; });
+		f->done(1);
+	});
+	measure("map a value through 10 ->transform steps", count / 10, [] {
+		auto initial = make_future<int>();
+		auto f = initial;
+		for(int i = 0; i < 10; ++i)
+			f = f->transform([](int v) { return v + 1; });
+		initial->done(1);
+	});
+	measure("map a value through 10 fused chain() steps", count / 10, [] {
+		auto initial = make_future<int>();
+		initial->chain()
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.future();
+		initial->done(1);
+	});
+	measure("map a value through 10 lazy transform steps, into a receiver", count / 10, [] {
+		lazy_call([] { return 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.start(sink { });
+	});
+	measure("map a value through 10 lazy transform steps, into a future", count / 10, [] {
+		lazy_call([] { return 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.transform([](int v) { return v + 1; })
+			.future();
+	});
+	measure("value propagated through 10 ->then links", count / 10, [] {
+		auto initial = make_future<std::string>();
+		auto f = initial;
+		for(int i = 0; i < 10; ++i) {
+			f = f->then([](const std::string &v) {
+				return resolved_future(v);
+			});
+		}
+		initial->done("a value long enough to need its own allocation");
+	});
+	measure("value propagated through 1000 ->then links (trampolined)", count / 1000, [] {
+		auto initial = make_future<int>();
+		auto f = initial;
+		for(int i = 0; i < 1000; ++i) {
+			f = f->then([](int v) {
+				return resolved_future(v + 1);
+			});
+		}
+		initial->done(0);
+	});
+	measure("value propagated through 10 ->then links, returning resolved_future", count / 10, [] {
+		auto initial = make_future<int>();
+		auto f = initial;
+		for(int i = 0; i < 10; ++i)
+			f = f->then([](int v) { return resolved_future(v + 1); });
+		initial->done(0);
+	});
+#if CPS_FUTURE_HAVE_COROUTINES
+	measure("value propagated through 10 co_await links", count / 10, [] {
+		auto initial = make_future<int>();
+		auto f = initial;
+		for(int i = 0; i < 10; ++i)
+			f = add_one(f);
+		initial->done(0);
+	});
+#endif
+	measure("fail propagated through 10 ->then links", count / 10, [] {
+		auto initial = make_future<std::string>();
+		auto f = initial;
+		for(int i = 0; i < 10; ++i) {
+			f = f->then([](const std::string &v) {
+				return resolved_future(v);
+			});
+		}
+		initial->fail(std::runtime_error("backend unavailable"));
+	});
+	measure("fail propagated through 10 ->then links (arena)", count / 10, [] {
+		cps::arena a;
+		arena_scope scope { a };
+		auto initial = make_future<std::string>();
+		auto f = initial;
+		for(int i = 0; i < 10; ++i) {
+			f = f->then([](const std::string &v) {
+				return resolved_future(v);
+			});
+		}
+		initial->fail(std::runtime_error("backend unavailable"));
+	});
+	measure("fail propagated through 10 ->then links (single_thread)", count / 10, [] {
+		using local = future<std::string, single_thread>;
+		auto initial = local::create_ptr();
+		auto f = initial;
+		for(int i = 0; i < 10; ++i) {
+			f = f->then([](const std::string &v) {
+				return local::create_ptr()->done(v);
+			});
+		}
+		initial->fail(std::runtime_error("backend unavailable"));
+	});
+	measure("needs_all over 10 pending futures", count / 10, [] {
+		std::shared_ptr<future<int>> in[10];
+		for(auto &f : in)
+			f = future<int>::create_shared();
+		auto all = needs_all(in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7], in[8], in[9]);
+		for(auto &f : in)
+			f->done(1);
+	});
+	/* Vector fan-in should cost the same per input however many inputs there are:
+	 * one allocation for each input, plus the vector and the result
+	 */
+	for(int n = 10; n <= 1000000; n *= 10) {
+		measure("needs_all over a vector of " + std::to_string(n) + " pending futures", std::max(1, 1000000 / n), [n] {
+			std::vector<future_ptr<int>> in;
+			in.reserve(n);
+			for(int i = 0; i < n; ++i)
+				in.push_back(make_future<int>());
+			auto all = needs_all(in);
+			for(auto &f : in)
+				f->done(1);
+		});
 	}
+	/* Collecting 1000 values: walking the inputs after needs_all, against gather and needs_all_into.
+	 * Each input costs three allocations - the future, its value and the copy we collect - and
+	 * the inputs share one vector. Beyond that, needs_all_into only allocates its result, while
+	 * the other two also need a vector for the values.
+	 */
+	{
+		const int n = 1000;
+		auto inputs = [n] {
+			std::vector<future_ptr<std::string>> in;
+			in.reserve(n);
+			for(int i = 0; i < n; ++i)
+				in.push_back(make_future<std::string>());
+			return in;
+		};
+		auto resolve = [](std::vector<future_ptr<std::string>> &in) {
+			for(auto &f : in)
+				f->done("a value long enough to need its own allocation");
+		};
+		measure("collect 1000 values with needs_all, then value() on each input", count / n, [&] {
+			auto in = inputs();
+			auto all = needs_all(in);
+			resolve(in);
+			std::vector<std::string> out;
+			out.reserve(in.size());
+			for(auto &f : in)
+				out.push_back(f->value());
+		});
+		measure("collect 1000 values with gather", count / n, [&] {
+			auto in = inputs();
+			auto all = gather(in);
+			resolve(in);
+		});
+		std::vector<std::string> storage(n);
+		measure("collect 1000 values with needs_all_into, into existing storage", count / n, [&] {
+			auto in = inputs();
+			auto all = needs_all_into(in, storage.data());
+			resolve(in);
+		});
+	}
+	/* Moving needs a lock: multi_thread allocates an extra block for that mutex, the lock pool doesn't */
+	measure("move (multi_thread)", count, move_future<multi_thread>);
+	measure("move (striped_multi_thread<64>)", count, move_future<striped_multi_thread<64>>);
+	const int threads = std::max(2u, std::thread::hardware_concurrency());
+	measure_contended("move (multi_thread)", threads, count, move_future<multi_thread>);
+	measure_contended("move (striped_multi_thread<64>)", threads, count, move_future<striped_multi_thread<64>>);
+	measure_contended("move (striped_multi_thread<1>)", threads, count, move_future<striped_multi_thread<1>>);
 	f2->done("");
-	auto elapsed = std::chrono::high_resolution_clock::now() - start;
-	std::cout
-		<< "Average iteration: "
-		<< (std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (float)count)
-		<< " ns"
-		<< std::endl;
 	std::cout << f2->describe() << std::endl;
 	return 0;
 }
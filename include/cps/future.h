@@ -9,6 +9,69 @@
  */
 #define CAN_COPY_FUTURES 0
 
+/**
+ * Set this to 1 if futures never cross threads, for example a program
+ * built around a single event loop. cps::future<T> then defaults to the
+ * single_thread policy, with plain integers rather than atomics and no
+ * locking. Individual futures can pick a policy with future<T, Policy>
+ * either way.
+ */
+#ifndef CPS_FUTURE_SINGLE_THREADED
+#define CPS_FUTURE_SINGLE_THREADED 0
+#endif
+
+/**
+ * Set this to the number of locks to share between all futures, rather
+ * than each future allocating a std::mutex of its own the first time
+ * it's copied or moved. See cps::striped_multi_thread.
+ */
+#ifndef CPS_FUTURE_LOCK_STRIPES
+#define CPS_FUTURE_LOCK_STRIPES 0
+#endif
+
+/**
+ * Each future has room for this many callbacks before it needs to
+ * allocate. Most futures only ever see one or two: an on_done,
+ * or the propagation from a ->then.
+ *
+ * The slots come after the hot fields, which fill the first cache line
+ * of a future<int>; the slots themselves take the next 96 bytes, so
+ * future<int> is 160 bytes by default. Setting this to 0, along with
+ * CPS_FUTURE_TIMING, brings future<int> down to a single cache line, at
+ * the cost of an allocation for every callback.
+ */
+#ifndef CPS_FUTURE_INLINE_TASKS
+#define CPS_FUTURE_INLINE_TASKS 2
+#endif
+
+/**
+ * Space for each of those callbacks, in bytes. This includes the
+ * bookkeeping for the task itself (two pointers), and should leave
+ * enough for a std::function plus that bookkeeping.
+ */
+#ifndef CPS_FUTURE_INLINE_TASK_SIZE
+#define CPS_FUTURE_INLINE_TASK_SIZE 48
+#endif
+
+/**
+ * Controls the timestamps behind elapsed() and describe(). 1 times
+ * every future, 0 turns timing off entirely (no clock reads), and
+ * N > 1 times one future in every N created on each thread.
+ */
+#ifndef CPS_FUTURE_TIMING
+#define CPS_FUTURE_TIMING 1
+#endif
+
+/**
+ * How many futures' callbacks can be running inside each other on one
+ * thread before further ones are queued, see detail::trampoline. This
+ * bounds the stack used by long ->then chains; 0 queues every nested
+ * resolution.
+ */
+#ifndef CPS_FUTURE_TRAMPOLINE_DEPTH
+#define CPS_FUTURE_TRAMPOLINE_DEPTH 32
+#endif
+
 /**
  * This flag... this flag should not exist.
  * However, sometimes we seem to be trying to throw an exception within
@@ -19,6 +82,16 @@
 
 #include <cps/future/error_code.h>
 #include <cps/future/is_string.h>
+#include <cps/future/policy.h>
+#include <cps/future/future_ptr.h>
+#include <cps/future/label.h>
+#include <cps/future/slab.h>
+#include <cps/future/arena.h>
+#include <cps/future/unique_function.h>
+#include <cps/future/trampoline.h>
+#include <cps/future/chain.h>
 #include <cps/future/implementation.h>
+#include <cps/future/lazy.h>
+#include <cps/future/coroutine.h>
 #include <cps/future/utils.h>
 
@@ -0,0 +1,253 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#if defined(__has_include)
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#include <memory_resource>
+#define CPS_FUTURE_HAVE_PMR 1
+#endif
+#endif
+
+#ifndef CPS_FUTURE_HAVE_PMR
+#define CPS_FUTURE_HAVE_PMR 0
+#endif
+
+namespace cps {
+
+namespace detail {
+
+/**
+ * The memory behind a cps::arena. Each allocation holds a reference,
+ * as does the arena itself, so nothing is freed until the arena and
+ * every future allocated from it have gone.
+ */
+class arena_state {
+public:
+	explicit arena_state(
+		std::size_t chunk_size
+#if CPS_FUTURE_HAVE_PMR
+		, std::pmr::memory_resource *upstream = nullptr
+#endif
+	):refs_(1),
+	  chunk_size_(chunk_size),
+#if CPS_FUTURE_HAVE_PMR
+	  upstream_(upstream),
+#endif
+	  current_(nullptr),
+	  remaining_(0)
+	{
+	}
+
+	~arena_state() {
+		for(auto &chunk : chunks_)
+			free_chunk(chunk.first, chunk.second);
+	}
+
+	/** Bump-allocates from the current chunk, starting a new one if it's full */
+	void *allocate(std::size_t size, std::size_t align) {
+		if(!std::align(align, size, current_, remaining_)) {
+			const auto bytes = std::max(chunk_size_, size + align);
+			current_ = allocate_chunk(bytes);
+			remaining_ = bytes;
+			chunks_.emplace_back(current_, bytes);
+			std::align(align, size, current_, remaining_);
+		}
+		auto p = current_;
+		current_ = static_cast<char *>(current_) + size;
+		remaining_ -= size;
+		add_ref();
+		return p;
+	}
+
+	/** Nothing to free individually, we just drop the reference */
+	void deallocate() noexcept { release(); }
+
+	void add_ref() noexcept { refs_.fetch_add(1, std::memory_order_relaxed); }
+	void release() noexcept {
+		if(refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+
+	/** Allocations still in use, not counting the arena's own reference */
+	std::size_t live() const noexcept { return refs_.load(std::memory_order_acquire) - 1; }
+
+private:
+	void *allocate_chunk(std::size_t bytes) {
+#if CPS_FUTURE_HAVE_PMR
+		if(upstream_)
+			return upstream_->allocate(bytes, alignof(std::max_align_t));
+#endif
+		return ::operator new(bytes);
+	}
+
+	void free_chunk(void *p, std::size_t bytes) noexcept {
+#if CPS_FUTURE_HAVE_PMR
+		if(upstream_)
+			return upstream_->deallocate(p, bytes, alignof(std::max_align_t));
+#endif
+		(void) bytes;
+		::operator delete(p);
+	}
+
+	std::atomic<std::size_t> refs_;
+	std::size_t chunk_size_;
+#if CPS_FUTURE_HAVE_PMR
+	std::pmr::memory_resource *upstream_;
+#endif
+	/** Everything we've allocated, with sizes */
+	std::vector<std::pair<void *, std::size_t>> chunks_;
+	/** Next free byte in the current chunk */
+	void *current_;
+	/** Bytes left in the current chunk */
+	std::size_t remaining_;
+};
+
+}
+
+/**
+ * Monotonic memory for a group of futures that all go away together,
+ * such as everything built to handle one request. Make an arena_scope
+ * and every future created on this thread while it's active - including
+ * the ones ->then and needs_all make for you - comes from the arena,
+ * along with the other memory futures allocate for themselves on this
+ * thread while it's active: callbacks which don't fit in a future's
+ * inline slots, the side block holding labels and exceptions, and the
+ * control blocks behind shared():
+ *
+ *     cps::arena a;
+ *     {
+ *         cps::arena_scope scope { a };
+ *         auto f = make_future<int>();
+ *         ...
+ *     }
+ *
+ * Allocation itself is not thread-safe, but futures from the arena can
+ * be resolved and released anywhere; anything they allocate on a thread
+ * without an active scope comes from the global heap as usual. If any
+ * of them outlive the arena, the memory stays around until the last one
+ * is released, so escaping futures are wasteful but never dangling.
+ */
+class arena {
+public:
+	explicit arena(
+		std::size_t chunk_size = 16384
+	):state_(new detail::arena_state(chunk_size))
+	{
+	}
+
+#if CPS_FUTURE_HAVE_PMR
+	/** An arena which takes its chunks from the given memory resource */
+	explicit arena(
+		std::pmr::memory_resource *upstream,
+		std::size_t chunk_size = 16384
+	):state_(new detail::arena_state(chunk_size, upstream))
+	{
+	}
+#endif
+
+	arena(const arena &) = delete;
+	arena &operator=(const arena &) = delete;
+
+	~arena() { state_->release(); }
+
+	/** Number of allocations from this arena still in use */
+	std::size_t live() const noexcept { return state_->live(); }
+
+	/** The arena futures on this thread are currently allocated from, if any */
+	static arena *current() noexcept { return current_ref(); }
+
+private:
+	friend class arena_scope;
+	template<typename> friend class arena_allocator;
+
+	static arena *&current_ref() noexcept {
+		static thread_local arena *current = nullptr;
+		return current;
+	}
+
+	detail::arena_state *state_;
+};
+
+/**
+ * Makes the given arena the current one for this thread until we go
+ * out of scope. Scopes nest.
+ */
+class arena_scope {
+public:
+	explicit arena_scope(
+		arena &a
+	) noexcept
+	 :previous_(arena::current_ref())
+	{
+		arena::current_ref() = &a;
+	}
+
+	arena_scope(const arena_scope &) = delete;
+	arena_scope &operator=(const arena_scope &) = delete;
+
+	~arena_scope() { arena::current_ref() = previous_; }
+
+private:
+	arena *previous_;
+};
+
+/**
+ * Allocator handing out memory from a cps::arena. Deallocation only
+ * drops the arena's reference count: the memory goes back when the
+ * whole arena does.
+ */
+template<typename T>
+class arena_allocator {
+public:
+	using value_type = T;
+
+	explicit arena_allocator(arena &a) noexcept:state_(a.state_) { }
+	template<typename U>
+	arena_allocator(const arena_allocator<U> &src) noexcept:state_(src.state_) { }
+
+	T *allocate(std::size_t n) { return static_cast<T *>(state_->allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T *, std::size_t) noexcept { state_->deallocate(); }
+
+private:
+	template<typename> friend class arena_allocator;
+	template<typename U, typename V>
+	friend bool operator==(const arena_allocator<U> &, const arena_allocator<V> &) noexcept;
+
+	detail::arena_state *state_;
+};
+
+template<typename T, typename U>
+inline bool operator==(const arena_allocator<T> &a, const arena_allocator<U> &b) noexcept { return a.state_ == b.state_; }
+template<typename T, typename U>
+inline bool operator!=(const arena_allocator<T> &a, const arena_allocator<U> &b) noexcept { return !(a == b); }
+
+namespace detail {
+
+/**
+ * Constructs a T in the given arena, for the odd bits of memory a
+ * future needs for itself. T's constructor gets the allocator as its
+ * first argument, so that T can hand the memory back when it's done.
+ */
+template<typename T, typename... Args>
+T *arena_new(arena &a, Args &&... args)
+{
+	arena_allocator<T> alloc { a };
+	auto p = alloc.allocate(1);
+	try {
+		return ::new(static_cast<void *>(p)) T(alloc, std::forward<Args>(args)...);
+	} catch(...) {
+		alloc.deallocate(p, 1);
+		throw;
+	}
+}
+
+}
+
+};
+
@@ -0,0 +1,108 @@
+#pragma once
+#include <type_traits>
+#include <utility>
+
+namespace cps {
+
+namespace detail {
+
+/** Where a chain starts: passes the value through untouched */
+struct identity_stage { };
+
+/** Two chain stages run back to back, as one continuation */
+template<typename F, typename G>
+struct fused_stage {
+	F first;
+	G second;
+
+	template<typename V>
+	auto operator()(const V &v) -> decltype(std::declval<G &>()(std::declval<F &>()(v))) {
+		return second(first(v));
+	}
+};
+
+}
+
+/**
+ * Builds up a series of ->transform steps without creating a future for
+ * each one. The steps are composed into a single function, so however
+ * many there are, only the future at the end is allocated:
+ *
+ *     auto len = f->chain()
+ *         .transform([](const std::string &s) { return trim(s); })
+ *         .transform([](const std::string &s) { return s.size(); })
+ *         .future();
+ *
+ * Nothing is registered on the source future until future() or then()
+ * is called. Failure and cancellation pass through as with transform,
+ * and an exception from any step fails the result.
+ */
+template<typename T, typename Policy, typename F>
+class chain {
+public:
+	chain(
+		future_ptr<T, Policy> source,
+		F stage
+	):source_(std::move(source)),
+	  stage_(std::move(stage))
+	{
+	}
+
+	/** Adds a step which maps the value so far to a plain value */
+	template<typename G>
+	chain<T, Policy, detail::fused_stage<F, G>> transform(G code) && {
+		return { std::move(source_), detail::fused_stage<F, G> { std::move(stage_), std::move(code) } };
+	}
+
+	/** Finishes the chain, returning a future for the result of the last step */
+	auto future() && -> decltype(std::declval<future_ptr<T, Policy> &>()->transform(std::declval<F>())) {
+		return source_->transform(std::move(stage_));
+	}
+
+	/**
+	 * Finishes the chain with a step which returns a future, as with ->then.
+	 * The steps so far get a future of their own here, so that an exception
+	 * from one of them reaches the error handlers just as it would without
+	 * the chain.
+	 */
+	template<typename G, typename... Args>
+	auto then(G code, Args... err) && -> decltype(std::declval<future_ptr<T, Policy> &>()->transform(std::declval<F>())->then(std::move(code), std::move(err)...)) {
+		return source_->transform(std::move(stage_))->then(std::move(code), std::move(err)...);
+	}
+
+private:
+	future_ptr<T, Policy> source_;
+	F stage_;
+};
+
+/** A chain with no steps yet: future() just copies the value */
+template<typename T, typename Policy>
+class chain<T, Policy, detail::identity_stage> {
+public:
+	chain(
+		future_ptr<T, Policy> source,
+		detail::identity_stage
+	):source_(std::move(source))
+	{
+	}
+
+	template<typename G>
+	chain<T, Policy, G> transform(G code) && {
+		return { std::move(source_), std::move(code) };
+	}
+
+	future_ptr<T, Policy> future() && {
+		return source_->transform([](const T &v) { return v; });
+	}
+
+	template<typename G, typename... Args>
+	auto then(G code, Args... err) && -> decltype(std::declval<future_ptr<T, Policy> &>()->then(std::move(code), std::move(err)...)) {
+		return source_->then(std::move(code), std::move(err)...);
+	}
+
+private:
+	future_ptr<T, Policy> source_;
+};
+
+};
+
@@ -0,0 +1,272 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <cps/future.h>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define CPS_FUTURE_HAVE_COROUTINES 1
+#endif
+#endif
+
+#ifndef CPS_FUTURE_HAVE_COROUTINES
+#define CPS_FUTURE_HAVE_COROUTINES 0
+#endif
+
+#if CPS_FUTURE_HAVE_COROUTINES
+
+namespace cps {
+
+namespace detail {
+
+/**
+ * Coroutine frames come in all sizes, so we round each one up to a
+ * multiple of 64 bytes and take it from the slab_pool for that size.
+ * Anything over a kilobyte goes to the global allocator.
+ */
+class frame_pool {
+public:
+	static void *allocate(std::size_t size) {
+		if(size > granularity * classes)
+			return ::operator new(size);
+		return allocate_from(size_class(size), std::make_index_sequence<classes>());
+	}
+
+	static void deallocate(void *p, std::size_t size) noexcept {
+		if(size > granularity * classes)
+			return ::operator delete(p);
+		deallocate_to(size_class(size), p, std::make_index_sequence<classes>());
+	}
+
+private:
+	static constexpr std::size_t granularity = 64;
+	static constexpr std::size_t classes = 16;
+
+	static std::size_t size_class(std::size_t size) noexcept { return size ? (size - 1) / granularity : 0; }
+
+	template<std::size_t... I>
+	static void *allocate_from(std::size_t c, std::index_sequence<I...>) {
+		static constexpr void *(*pools[])() = {
+			&slab_pool<(I + 1) * granularity, alignof(std::max_align_t)>::allocate...
+		};
+		return pools[c]();
+	}
+
+	template<std::size_t... I>
+	static void deallocate_to(std::size_t c, void *p, std::index_sequence<I...>) noexcept {
+		static constexpr void (*pools[])(void *) noexcept = {
+			&slab_pool<(I + 1) * granularity, alignof(std::max_align_t)>::deallocate...
+		};
+		pools[c](p);
+	}
+};
+
+/**
+ * Lets a coroutine return a future: the future is created before the
+ * coroutine body starts, and resolved by co_return or by an exception
+ * escaping the body. R is the declared return type, either a
+ * future_ptr or a std::shared_ptr to the future.
+ */
+template<typename R, typename T, typename Policy>
+class future_promise {
+public:
+	future_promise():result_(future<T, Policy>::create_ptr()) { }
+
+	R get_return_object() { return result_; }
+
+	/* Run eagerly, like the callback code this replaces, and let the frame go as soon as we finish */
+	std::suspend_never initial_suspend() noexcept { return { }; }
+	std::suspend_never final_suspend() noexcept { return { }; }
+
+	/* If the caller has cancelled our future, even while we're finishing, the result has nowhere to go */
+	void return_value(T v) {
+		result_->try_done(std::move(v));
+	}
+
+	/**
+	 * Fails our future with the exception escaping the body. If it's
+	 * already resolved - cancelled by the caller, or a callback threw
+	 * while co_return was resolving it - the exception is dropped: we
+	 * may be running inside another future's callback, and rethrowing
+	 * would leave this frame behind.
+	 */
+	void unhandled_exception() {
+		result_->try_fail_exception_pointer(std::current_exception());
+	}
+
+	static void *operator new(std::size_t size) { return frame_pool::allocate(size); }
+	static void operator delete(void *p, std::size_t size) noexcept { frame_pool::deallocate(p, size); }
+
+private:
+	future_ptr<T, Policy> result_;
+};
+
+/**
+ * What co_await on a future gives you. The coroutine is only suspended
+ * if the future is still pending, and if the future becomes ready while
+ * we're registering the callback, we carry on without suspending rather
+ * than resuming from inside the callback - so awaiting a chain of
+ * already-ready futures never grows the stack.
+ */
+template<typename T, typename Policy>
+class future_awaiter {
+public:
+	explicit future_awaiter(future_ptr<T, Policy> f):f_(std::move(f)), claimed_(false) { }
+
+	bool await_ready() const { return f_->is_ready(); }
+
+	bool await_suspend(std::coroutine_handle<> h) {
+		f_->on_ready([this, h](future<T, Policy> &) {
+			/* Whoever gets here second resumes the coroutine */
+			if(claimed_.exchange(true, std::memory_order_acq_rel))
+				h.resume();
+		});
+		return !claimed_.exchange(true, std::memory_order_acq_rel);
+	}
+
+	/** Returns the value, or throws the failure (or a std::runtime_error if we were cancelled) */
+	T await_resume() { return pass(std::is_copy_constructible<T>()); }
+
+private:
+	/** If we hold the only reference, there's no need to copy */
+	T pass(std::true_type) { return f_->use_count() == 1 ? f_->take() : f_->value(); }
+	T pass(std::false_type) { return f_->take(); }
+
+	future_ptr<T, Policy> f_;
+	/** Set by whichever of await_suspend and the callback finishes first */
+	std::atomic<bool> claimed_;
+};
+
+/**
+ * What co_await on a cps::lazy gives you. The pipeline starts when we
+ * suspend, with a receiver that keeps the outcome here in the
+ * coroutine frame, so awaiting a lazy allocates nothing. As with
+ * future_awaiter, a pipeline that finishes before start() returns
+ * carries on without suspending.
+ */
+template<typename T, typename Start>
+class lazy_awaiter {
+public:
+	explicit lazy_awaiter(lazy<T, Start> work):work_(std::move(work)), outcome_(outcome::none), claimed_(false) { }
+	lazy_awaiter(const lazy_awaiter &) = delete;
+	lazy_awaiter &operator=(const lazy_awaiter &) = delete;
+
+	~lazy_awaiter() {
+		if(outcome_ == outcome::value)
+			value_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h) {
+		handle_ = h;
+		std::move(work_).start(receiver { this });
+		return !claimed_.exchange(true, std::memory_order_acq_rel);
+	}
+
+	/** Returns the value, or throws the failure (or a std::runtime_error if the pipeline was cancelled) */
+	T await_resume() {
+		switch(outcome_) {
+		case outcome::value: return std::move(value_.get());
+		case outcome::error: std::rethrow_exception(ex_);
+		default: throw std::runtime_error("lazy was cancelled");
+		}
+	}
+
+private:
+	enum class outcome { none, value, error, cancelled };
+
+	/** Records the outcome in the awaiter, then resumes the coroutine if it has already suspended */
+	struct receiver {
+		lazy_awaiter *awaiter;
+
+		template<typename V>
+		void set_value(V &&v) {
+			awaiter->value_.construct(std::forward<V>(v));
+			awaiter->finish(outcome::value);
+		}
+		void set_error(std::exception_ptr ex) {
+			awaiter->ex_ = std::move(ex);
+			awaiter->finish(outcome::error);
+		}
+		void set_cancelled() { awaiter->finish(outcome::cancelled); }
+	};
+
+	void finish(outcome o) {
+		outcome_ = o;
+		/* Whoever gets here second resumes the coroutine */
+		if(claimed_.exchange(true, std::memory_order_acq_rel))
+			handle_.resume();
+	}
+
+	lazy<T, Start> work_;
+	uninitialized<T> value_;
+	std::exception_ptr ex_;
+	outcome outcome_;
+	/** Set by whichever of await_suspend and the receiver finishes first */
+	std::atomic<bool> claimed_;
+	std::coroutine_handle<> handle_;
+};
+
+}
+
+/**
+ * Waits for a future inside a coroutine:
+ *
+ *     future_ptr<int> total() {
+ *         auto a = co_await fetch("a");
+ *         auto b = co_await fetch("b");
+ *         co_return a + b;
+ *     }
+ *
+ * Only available when building as C++20, see CPS_FUTURE_HAVE_COROUTINES.
+ */
+template<typename T, typename Policy>
+inline detail::future_awaiter<T, Policy> operator co_await(future_ptr<T, Policy> f) {
+	return detail::future_awaiter<T, Policy>(std::move(f));
+}
+
+/** As above, for code using the std::shared_ptr API */
+template<typename T, typename Policy>
+inline detail::future_awaiter<T, Policy> operator co_await(std::shared_ptr<future<T, Policy>> f) {
+	return detail::future_awaiter<T, Policy>(f->ptr());
+}
+
+/**
+ * Starts a lazy pipeline and waits for its outcome inside a coroutine,
+ * without allocating a future for it:
+ *
+ *     auto config = co_await lazy_call([] { return read_config(); });
+ */
+template<typename T, typename Start>
+inline detail::lazy_awaiter<T, Start> operator co_await(lazy<T, Start> &&work) {
+	return detail::lazy_awaiter<T, Start>(std::move(work));
+}
+
+};
+
+namespace std {
+
+/** Coroutines can return future_ptr<T> */
+template<typename T, typename Policy, typename... Args>
+struct coroutine_traits<cps::future_ptr<T, Policy>, Args...> {
+	using promise_type = cps::detail::future_promise<cps::future_ptr<T, Policy>, T, Policy>;
+};
+
+/** ... or std::shared_ptr<future<T>> */
+template<typename T, typename Policy, typename... Args>
+struct coroutine_traits<std::shared_ptr<cps::future<T, Policy>>, Args...> {
+	using promise_type = cps::detail::future_promise<std::shared_ptr<cps::future<T, Policy>>, T, Policy>;
+};
+
+}
+
+#endif
+
@@ -32,7 +32,8 @@ enum class future_errc {
 	is_pending = 1,
 	is_failed,
 	is_cancelled,
-	no_more_items
+	no_more_items,
+	value_taken
 };
 
 namespace detail {
@@ -61,6 +62,8 @@ public:
 			return "future is cancelled";
 		case cps::future_errc::no_more_items:
 			return "no more items";
+		case cps::future_errc::value_taken:
+			return "future value has already been taken";
 		default:
 			return "unknown cps::future error";
 		}
@@ -123,6 +126,8 @@ future_category::equivalent(
 		return code == make_error_code(future_errc::is_cancelled);
 	case future_errc::no_more_items:
 		return code == make_error_code(future_errc::no_more_items);
+	case future_errc::value_taken:
+		return code == make_error_code(future_errc::value_taken);
 	default:
 		return false;
 	}
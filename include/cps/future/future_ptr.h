@@ -0,0 +1,119 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+#include <cps/future/policy.h>
+
+namespace cps {
+
+template<typename T, typename Policy = default_thread_policy> class future;
+
+/**
+ * Handle to a cps::future.
+ *
+ * This is an intrusive pointer: the reference count lives inside the
+ * future itself, so there's a single allocation per future and copying
+ * a handle is one increment - no separate control block, and no
+ * weak_ptr to lock.
+ *
+ * A future_ptr converts implicitly to std::shared_ptr<future<T>>, for
+ * code that expects the older shared_ptr-based API. That conversion
+ * allocates a control block, so prefer future_ptr where it matters.
+ */
+template<typename T, typename Policy = default_thread_policy>
+class future_ptr {
+public:
+	using element_type = future<T, Policy>;
+
+	/** Tag for taking over an existing reference rather than adding a new one */
+	struct adopt_t { };
+
+	future_ptr() noexcept:p_(nullptr) { }
+	future_ptr(std::nullptr_t) noexcept:p_(nullptr) { }
+
+	/** Shares ownership of the given future */
+	explicit future_ptr(
+		future<T, Policy> *p
+	) noexcept
+	 :p_(p)
+	{
+		if(p_) p_->add_ref();
+	}
+
+	/**
+	 * Takes over a reference that the caller already holds. Adopting the
+	 * one a future starts with marks it as owned by handles, see
+	 * future::dispatch_tasks.
+	 */
+	future_ptr(
+		future<T, Policy> *p,
+		adopt_t
+	) noexcept
+	 :p_(p)
+	{
+		if(p_ && !p_->owned_by_handles_)
+			p_->owned_by_handles_ = true;
+	}
+
+	future_ptr(
+		const future_ptr &src
+	) noexcept
+	 :future_ptr(src.p_)
+	{
+	}
+
+	future_ptr(
+		future_ptr &&src
+	) noexcept
+	 :p_(src.p_)
+	{
+		src.p_ = nullptr;
+	}
+
+	~future_ptr() { reset(); }
+
+	future_ptr &operator=(future_ptr src) noexcept {
+		swap(src);
+		return *this;
+	}
+
+	void swap(future_ptr &other) noexcept { std::swap(p_, other.p_); }
+
+	/** Drops our reference, if we have one */
+	void reset() noexcept {
+		if(p_) {
+			auto p = p_;
+			p_ = nullptr;
+			p->release();
+		}
+	}
+
+	future<T, Policy> *get() const noexcept { return p_; }
+	future<T, Policy> &operator*() const noexcept { return *p_; }
+	future<T, Policy> *operator->() const noexcept { return p_; }
+	explicit operator bool() const noexcept { return p_ != nullptr; }
+
+	/** Number of references to the future, including ours */
+	std::size_t use_count() const noexcept { return p_ ? p_->use_count() : 0; }
+
+	/** Compatibility with the shared_ptr API */
+	operator std::shared_ptr<future<T, Policy>>() const {
+		return p_ ? p_->shared() : nullptr;
+	}
+
+private:
+	future<T, Policy> *p_;
+};
+
+template<typename T, typename Policy>
+inline bool operator==(const future_ptr<T, Policy> &a, const future_ptr<T, Policy> &b) noexcept { return a.get() == b.get(); }
+template<typename T, typename Policy>
+inline bool operator!=(const future_ptr<T, Policy> &a, const future_ptr<T, Policy> &b) noexcept { return a.get() != b.get(); }
+template<typename T, typename Policy>
+inline bool operator==(const future_ptr<T, Policy> &a, std::nullptr_t) noexcept { return !a; }
+template<typename T, typename Policy>
+inline bool operator!=(const future_ptr<T, Policy> &a, std::nullptr_t) noexcept { return !!a; }
+
+};
+
@@ -1,10 +1,17 @@
 #pragma once
+#include <array>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <mutex>
 #include <atomic>
 #include <memory>
+#include <functional>
 #include <string>
 #include <vector>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <algorithm>
 #include <chrono>
 #include <exception>
@@ -13,6 +20,15 @@
 
 #include <cps/future/error_code.h>
 #include <cps/future/is_string.h>
+#include <cps/future/policy.h>
+#include <cps/future/future_ptr.h>
+#include <cps/future/label.h>
+#include <cps/future/arena.h>
+#include <cps/future/unique_function.h>
+#include <cps/future/storage.h>
+#include <cps/future/timing.h>
+#include <cps/future/trampoline.h>
+#include <cps/future/chain.h>
 
 #ifdef UNCAUGHT_EXCEPTION_DEBUGGING
 #include <iostream>
@@ -20,25 +36,101 @@
 
 namespace cps {
 
+namespace detail {
+
+template<typename Future, typename Alloc> class allocated_future;
+
+template<typename F, typename... Args>
+struct is_callable_test {
+	template<typename G>
+	static auto test(int) -> decltype(std::declval<G>()(std::declval<Args>()...), std::true_type());
+	template<typename>
+	static std::false_type test(...);
+	using type = decltype(test<F>(0));
+};
+
+/** Tells us whether F can be called with the given arguments */
+template<typename F, typename... Args>
+struct is_callable : is_callable_test<F, Args...>::type { };
+
+/** Tells us whether a parameter pack starts with std::allocator_arg */
+template<typename... Args>
+struct starts_with_allocator_arg : std::false_type { };
+template<typename First, typename... Rest>
+struct starts_with_allocator_arg<First, Rest...> : std::is_same<typename std::decay<First>::type, std::allocator_arg_t> { };
+
+template<
+	typename Future,
+	typename... Label,
+	typename = typename std::enable_if<!starts_with_allocator_arg<Label...>::value>::type
+>
+future_ptr<typename Future::value_type, typename Future::policy_type> create_as(Label &&... label);
+template<typename Future, typename Alloc, typename... Label>
+future_ptr<typename Future::value_type, typename Future::policy_type> create_as(std::allocator_arg_t, const Alloc &alloc, Label &&... label);
+
+}
+
 /**
+ * A value of type T which will be available at some point.
+ *
+ * Policy says whether this future can be shared between threads: the
+ * default multi_thread uses atomics throughout, while single_thread
+ * swaps them for plain loads and stores, and the mutex for a no-op.
  */
-template<typename T>
+template<typename T, typename Policy>
 class future {
 
 public:
-	/* Probably not very useful since the API is returning shared_ptr all over the shop */
-	static std::unique_ptr<future<T>> create(
-		const std::string &label = u8"unlabelled future"
+	/* Probably not very useful since the API is returning future_ptr all over the shop */
+	template<typename... Label>
+	static std::unique_ptr<future<T, Policy>> create(
+		Label &&... label
 	) {
-		return std::unique_ptr<future<T>>(new future<T>(label));
+		return std::unique_ptr<future<T, Policy>>(new future<T, Policy>(std::forward<Label>(label)...));
 	}
-	static std::shared_ptr<future<T>> create_shared(
-		const std::string &label = u8"unlabelled future"
+	/**
+	 * Creates a new future on the heap, owned by the returned handle.
+	 * Takes an optional label, see the constructors. If there's an
+	 * arena_scope active on this thread, the future comes from that
+	 * arena instead.
+	 */
+	template<
+		typename... Label,
+		typename = typename std::enable_if<!detail::starts_with_allocator_arg<Label...>::value>::type
+	>
+	static future_ptr<T, Policy> create_ptr(
+		Label &&... label
 	) {
-		auto p = std::make_shared<future<T>>(label);
-		p->shared(p);
-		return p;
+		return detail::create_as<future<T, Policy>>(std::forward<Label>(label)...);
 	}
+	/**
+	 * Creates a new future using memory from the given allocator, which
+	 * is also used to free it once the last handle goes away:
+	 *
+	 *     future<int>::create_ptr(std::allocator_arg, slab_allocator<int>(), "label"_label)
+	 */
+	template<typename Alloc, typename... Label>
+	static future_ptr<T, Policy> create_ptr(
+		std::allocator_arg_t,
+		const Alloc &alloc,
+		Label &&... label
+	) {
+		return detail::create_as<future<T, Policy>>(std::allocator_arg, alloc, std::forward<Label>(label)...);
+	}
+	/**
+	 * As create_ptr, but for code using the std::shared_ptr API.
+	 */
+	template<typename... Label>
+	static std::shared_ptr<future<T, Policy>> create_shared(
+		Label &&... label
+	) {
+		return create_ptr(std::forward<Label>(label)...)->shared();
+	}
+
+	/** The type of value this future will eventually hold */
+	using value_type = T;
+	/** Our threading policy */
+	using policy_type = Policy;
 
 	using checkpoint = std::chrono::high_resolution_clock::time_point;
 
@@ -63,8 +155,8 @@ public:
 	 * Copy constructor with locking semantics.
 	 */
 	future(
-		const future<T> &src
-	):future(src, std::lock_guard<std::mutex>(src.mutex_))
+		const future<T, Policy> &src
+	):future(src, std::lock_guard<typename Policy::mutex>(src.construction_lock()))
 	{
 	}
 #else
@@ -73,93 +165,136 @@ public:
 	 * risk of existing callbacks triggering more than once.
 	 */
 	future(
-		const future<T> &src
+		const future<T, Policy> &src
 	) = delete;
 #endif
 
 	/**
-	 * Move constructor with locking semantics.
+	 * Move constructor with locking semantics. Not noexcept: a label or
+	 * exception we take over needs a cold block of our own.
 	 * @param src source future to move from
 	 */
 	future(
-		future<T> &&src
-	) noexcept
-	 :future(
+		future<T, Policy> &&src
+	):future(
 		std::move(src),
-		std::lock_guard<std::mutex>(src.mutex_)
+		std::lock_guard<typename Policy::mutex>(src.construction_lock())
 	 )
 	{
 	}
 
 	/** Default constructor - nothing special here */
 	future(
-		const std::string &label = u8"unlabelled future"
-	):state_(state::pending),
-	  weak_ptr_(),
-	  label_(label),
-	  ex_(nullptr),
-	  created_(std::chrono::high_resolution_clock::now())
+	):future(default_label())
 	{
 	}
 
 	/**
-	 * Default destructor too - virtual, in case anyone wants to subclass.
+	 * Creates a future with a label that outlives it, such as
+	 * "some future"_label. We only store the pointer.
 	 */
-	virtual ~future() { }
+	future(
+		cps::label label
+	):refs_(1),
+	  slots_used_(0),
+	  owned_by_handles_(false),
+	  state_(0),
+	  cold_(nullptr),
+	  label_(label.c_str())
+	{
+	}
 
-	/** Returns the shared_ptr associated with this instance */
-	std::shared_ptr<future<T>>
-	shared()
+	/**
+	 * Creates a future with a label that we need to keep a copy of.
+	 * Plain char arrays come here too: we can't tell a string literal
+	 * from an array on the stack, so those are copied as well.
+	 */
+	future(
+		const std::string &label
+	):future(default_label())
 	{
-		/* Member function is from a dependent base so give the name lookup a nudge
-		 * in the right (this->) direction
-		 */
-		std::lock_guard<std::mutex> guard { mutex_ };
-		auto p = weak_ptr_.lock();
-		if(p)
-			return p;
+		auto &c = cold();
+		c.label = label;
+		label_ = c.label.c_str();
+	}
 
-		p = std::shared_ptr<future<T>>(this);
-		weak_ptr_ = p;
-		return p;
+	/**
+	 * Default destructor too - virtual, in case anyone wants to subclass.
+	 * Any tasks still queued at this point will never run, so we just
+	 * release them.
+	 */
+	virtual ~future() {
+		const auto current = state_.load(std::memory_order_acquire);
+		destroy_tasks(task_list(current));
+		if(state_from(current) == state::done)
+			value_.destroy();
+		if(auto c = cold_.load(std::memory_order_acquire))
+			c->dispose();
 	}
 
-	/** Returns the shared_ptr associated with this instance */
-	std::shared_ptr<future<T>>
-	shared(std::shared_ptr<future<T>> p)
+	/** Returns a new handle to this instance */
+	future_ptr<T, Policy>
+	ptr()
 	{
-		/* Member function is from a dependent base so give the name lookup a nudge
-		 * in the right (this->) direction
-		 */
-		std::lock_guard<std::mutex> guard { mutex_ };
-		weak_ptr_ = std::move(p);
-		return p;
+		return future_ptr<T, Policy>(this);
+	}
+
+	/**
+	 * Returns a std::shared_ptr to this instance, holding a reference of
+	 * its own. Each call allocates a new control block, from the current
+	 * arena if there is one.
+	 */
+	std::shared_ptr<future<T, Policy>>
+	shared()
+	{
+		add_ref();
+		const auto release = [](future<T, Policy> *f) { f->release(); };
+		if(auto a = arena::current())
+			return std::shared_ptr<future<T, Policy>>(this, release, arena_allocator<future<T, Policy>>(*a));
+		return std::shared_ptr<future<T, Policy>>(this, release);
 	}
 
+	/** Number of references currently held to this instance */
+	std::size_t use_count() const { return refs_.load(std::memory_order_relaxed); }
+
+	/*
+	 * The handlers below accept any callable - a lambda, function pointer,
+	 * std::function or cps::unique_function - and store it directly in
+	 * the task node, so there's no extra layer of type erasure and,
+	 * for small callables, no allocation.
+	 */
+
 	/** Add a handler to be called when this future is marked as ready */
-	std::shared_ptr<future<T>>
-	on_ready(std::function<void(future<T> &)> code)
+	template<typename F>
+	future_ptr<T, Policy>
+	on_ready(F code)
 	{
-		return call_when_ready(code);
+		return call_when_ready(std::move(code));
 	}
 
-	/** Add a handler to be called when this future is marked as done */
-	std::shared_ptr<future<T>>
-	on_done(std::function<void(T)> code)
+	/**
+	 * Add a handler to be called when this future is marked as done.
+	 * The handler takes a copy of the value, or a const reference to it
+	 * if T can't be copied.
+	 */
+	template<typename F>
+	future_ptr<T, Policy>
+	on_done(F code)
 	{
-		return call_when_ready([code](future<T> &f) {
+		return call_when_ready([code = std::move(code)](future<T, Policy> &f) mutable {
 			if(f.is_done()) {
 				// std::cout << "will call value in ->on_Done handler\n";
-				code(f.value());
+				code(f.get_ref());
 			}
 		});
 	}
 
-	/** Add a handler to be called if this future fails */
-	std::shared_ptr<future<T>>
-	on_fail(std::function<void(std::string)> code)
+	/** Add a handler to be called with the failure reason if this future fails */
+	template<typename F>
+	future_ptr<T, Policy>
+	on_fail(F code)
 	{
-		return call_when_ready([code](future<T> &f) {
+		return call_when_ready([code = std::move(code)](future<T, Policy> &f) mutable {
 			if(f.is_failed())
 				code(f.failure_reason());
 		});
@@ -167,10 +302,10 @@ public:
 
 	/** Add a handler to be called if this future fails */
 	template<typename E>
-	std::shared_ptr<future<T>>
+	future_ptr<T, Policy>
 	on_fail(std::function<void(const E &)> code)
 	{
-		return call_when_ready([code](future<T> &f) {
+		return call_when_ready([code = std::move(code)](future<T, Policy> &f) {
 			if(f.is_failed() && f.exception_ptr()) {
 				try {
 					std::rethrow_exception(f.exception_ptr());
@@ -184,29 +319,24 @@ public:
 		});
 	}
 
-	/** Add a handler to be called if this future is cancelled */
-	std::shared_ptr<future<T>> on_cancel(std::function<void(future<T> &)> code)
-	{
-		return call_when_ready([code](future<T> &f) {
-			if(f.is_cancelled())
-				code(f);
-		});
-	}
-
-	/** Add a handler to be called if this future is cancelled */
-	std::shared_ptr<future<T>> on_cancel(std::function<void()> code)
+	/**
+	 * Add a handler to be called if this future is cancelled. The
+	 * handler can take the future, or nothing at all.
+	 */
+	template<typename F>
+	future_ptr<T, Policy> on_cancel(F code)
 	{
-		return call_when_ready([code](future<T> &f) {
+		return call_when_ready([code = std::move(code)](future<T, Policy> &f) mutable {
 			if(f.is_cancelled())
-				code();
+				call_with_future(code, f, detail::is_callable<F &, future<T, Policy> &>());
 		});
 	}
 
 	/** Mark this future as done */
-	std::shared_ptr<future<T>> done(T v)
+	future_ptr<T, Policy> done(T v)
 	{
-		return apply_state([v = std::move(v)](future<T>&f) {
-			f.value_ = std::move(v);
+		return apply_state([&v](future<T, Policy>&f) {
+			f.value_.construct(std::move(v));
 		}, state::done);
 	}
 
@@ -218,7 +348,7 @@ public:
 			bool
 		>::type * = nullptr
 	>
-	std::shared_ptr<future<T>>
+	future_ptr<T, Policy>
 	fail(
 		const U ex
 	)
@@ -237,103 +367,117 @@ public:
 			bool
 		>::type * = nullptr
 	>
-	std::shared_ptr<future<T>> fail(
+	future_ptr<T, Policy> fail(
 		const U ex
 	)
 	{
 		// std::cout << "Calling exception-handling fail(" << ex.what() << ")\n";
-		return apply_state([&ex](future<T>&f) {
-			try {
-				throw ex;
-			} catch(const std::exception &e) {
-				// std::cout << "Will catch! " << e.what() << "\n";
-				f.failure_reason_ = e.what();
-				f.ex_ = std::current_exception();
-			} catch(...) {
-				// std::cout << "Will catch! (generic!)\n";
-				f.failure_reason_ = "unknown";
-				f.ex_ = std::current_exception();
-			}
-			// std::cout << "We're done!\n";
+		/* No need to throw this just to get hold of an exception_ptr,
+		 * and the failure reason can wait until someone asks for it
+		 */
+		return apply_state([&ex](future<T, Policy>&f) {
+			f.cold().ex = std::make_exception_ptr(ex);
 		}, state::failed);
 	}
 
-	template<typename U>
-	std::shared_ptr<
-		cps::future<T>
-	>
-	fail_from(const cps::future<U> &f) {
+	template<typename U, typename P>
+	future_ptr<T, Policy>
+	fail_from(const cps::future<U, P> &f) {
 		// std::cout << "->fail_from with " << describe() << " taking info from " << f.describe() << "\n";
 		if(!f.is_failed())
 			throw std::logic_error("future is not failed");
 
-		return apply_state([&f](future<T>&me) {
-			try {
-				// std::cout << "Will throw!\n";
-				std::rethrow_exception(f.exception_ptr());
-			} catch(const std::exception &e) {
-				// std::cout << "Will catch!\n";
-				me.ex_ = std::current_exception();
-				me.failure_reason_ = e.what();
-			} catch(...) {
-				// std::cout << "Will catch!\n";
-				me.ex_ = std::current_exception();
-				me.failure_reason_ = "unknown";
-			}
-			// std::cout << "We're done!\n";
+		/* Sharing the exception_ptr is enough: the failure reason
+		 * will be worked out from that if anyone asks for it.
+		 */
+		return apply_state([&f](future<T, Policy>&me) {
+			me.cold().ex = f.exception_ptr();
 		}, state::failed);
 	}
 
 	/**
-	 * Returns the current value for this future.
+	 * Returns a copy of the current value for this future.
 	 * Will throw a std::runtime_error if we're not marked as done.
 	 */
 	T value() const {
 		// std::cout << "calling ->value on " << describe() << "\n";
+#ifdef UNCAUGHT_EXCEPTION_DEBUGGING
+		if(false && is_failed() && std::uncaught_exception()) {
+			std::cerr << "Want to rethrow our exception, but we are already in an exception, so that's probably a bad idea\n";
+			auto eptr = std::current_exception();
+			try {
+				std::rethrow_exception(eptr);
+			} catch(const std::exception &e) {
+				std::cerr << " - we were in a s::e as " << e.what() << "\n";
+			} catch(const std::string &e) {
+				std::cerr << " - we were in a string as " << e << "\n";
+			} catch(const char *e) {
+				std::cerr << " - we were in a char string as " << e << "\n";
+			} catch(...) {
+				std::cerr << " - we were in something else\n";
+			}
+			return T();
+		}
+#endif
+		return get_ref();
+	}
+
+	/**
+	 * Returns a reference to the current value for this future, which
+	 * stays valid for as long as the future does (or until someone
+	 * calls take()).
+	 * Will throw a std::runtime_error if we're not marked as done, and
+	 * a std::logic_error if the value has been taken.
+	 */
+	const T &get_ref() const {
 		/* Only read this once */
-		const state s { state_ };
-		switch(s) {
+		const auto v = state_.load(std::memory_order_acquire);
+		switch(state_from(v)) {
 		case state::pending:
 			throw std::runtime_error("future is not complete");
 		case state::failed:
-#ifdef UNCAUGHT_EXCEPTION_DEBUGGING
-			if(false && std::uncaught_exception()) {
-				std::cerr << "Want to rethrow our exception, but we are already in an exception, so that's probably a bad idea\n";
-				auto eptr = std::current_exception();
-				try {
-					std::rethrow_exception(eptr);
-				} catch(const std::exception &e) {
-					std::cerr << " - we were in a s::e as " << e.what() << "\n";
-				} catch(const std::string &e) {
-					std::cerr << " - we were in a string as " << e << "\n";
-				} catch(const char *e) {
-					std::cerr << " - we were in a char string as " << e << "\n";
-				} catch(...) {
-					std::cerr << " - we were in something else\n";
-				}
-				return value_;
-			} else {
-#endif
-				if(ex_) {
-					std::rethrow_exception(ex_);
-				} else {
-					throw std::logic_error("no exception available");
-				}
-#ifdef UNCAUGHT_EXCEPTION_DEBUGGING
+			if(auto c = cold_.load(std::memory_order_acquire)) {
+				if(c->ex)
+					std::rethrow_exception(c->ex);
 			}
-#endif
+			throw std::logic_error("no exception available");
 		case state::cancelled:
 			throw std::runtime_error("future was cancelled");
 		default:
-			return value_;
+			if(v & taken_bit)
+				throw std::logic_error("future value has already been taken");
+			return value_.get();
 		}
 	}
 
+	/**
+	 * Moves the value out of this future. This can only happen once:
+	 * afterwards, any attempt to read the value will throw a
+	 * std::logic_error, as will a second take().
+	 * Will throw a std::runtime_error if we're not marked as done.
+	 */
+	T take() {
+		auto v = state_.load(std::memory_order_acquire);
+		do {
+			if(state_from(v) != state::done || (v & taken_bit)) {
+				/* get_ref() knows which exception to throw */
+				get_ref();
+				throw std::logic_error("future value is not available");
+			}
+		} while(!state_.compare_exchange_weak(v, v | taken_bit, std::memory_order_acq_rel));
+		return std::move(value_.get());
+	}
+
+	/**
+	 * Returns the current value for this future, or sets ec and returns
+	 * a default-constructed T if we're not marked as done, or if the
+	 * value has been taken.
+	 */
 	T value(std::error_code &ec) const {
 		// std::cout << "calling ->value on " << describe() << "\n";
 		/* Only read this once */
-		const state s { state_ };
-		switch(s) {
+		const auto v = state_.load(std::memory_order_acquire);
+		switch(state_from(v)) {
 		case state::pending:
 			ec = make_error_code(future_errc::is_pending);
 			return T();
@@ -344,7 +488,11 @@ public:
 			ec = make_error_code(future_errc::is_cancelled);
 			return T();
 		default:
-			return value_;
+			if(v & taken_bit) {
+				ec = make_error_code(future_errc::value_taken);
+				return T();
+			}
+			return value_.get();
 		}
 	}
 
@@ -366,12 +514,13 @@ public:
 	>
 	auto
 	exception_hoisting_callback(
-		U ok,
+		/* Only here so we can deduce the ok callback's type */
+		const U &,
 		V code
-	) -> std::function<decltype(ok(T()))(const std::exception_ptr &)>
+	) -> unique_function<decltype(std::declval<U &>()(std::declval<T>()))(const std::exception_ptr &)>
 	{
-		using return_type = decltype(ok(T()));
-		return [code](const std::exception_ptr &original) -> return_type {
+		using return_type = decltype(std::declval<U &>()(std::declval<T>()));
+		return [code = std::move(code)](const std::exception_ptr &original) mutable -> return_type {
 			bool matched = false;
 			std::string msg;
 			try {
@@ -409,15 +558,16 @@ public:
 	>
 	auto
 	exception_hoisting_callback(
-		U ok,
+		/* Only here so we can deduce the ok callback's type */
+		const U &,
 		V code
-	) -> std::function<
-		decltype(ok(T()))(const std::exception_ptr &)
+	) -> unique_function<
+		decltype(std::declval<U &>()(std::declval<T>()))(const std::exception_ptr &)
 	>
 	{
-		using return_type = decltype(ok(T()));
+		using return_type = decltype(std::declval<U &>()(std::declval<T>()));
 		typedef typename std::remove_pointer<decltype(arg_type_for(&V::operator()))>::type exception_type;
-		return [code](const std::exception_ptr &original) -> return_type {
+		return [code = std::move(code)](const std::exception_ptr &original) mutable -> return_type {
 			try {
 				std::rethrow_exception(original);
 			} catch(const exception_type &e) {
@@ -437,8 +587,11 @@ public:
 	 *
 	 * Callbacks will be passed either the current value, or the failure reason:
 	 *
-	 * * ok(this->value()) -> std::shared_ptr<future<X>>
-	 * * err(this->failure_reason()) -> std::shared_ptr<future<X>>
+	 * * ok(this->value()) -> future_ptr<X>
+	 * * err(this->failure_reason()) -> future_ptr<X>
+	 *
+	 * std::shared_ptr<future<X>> works in place of future_ptr<X> too, in which
+	 * case that's also what we return.
 	 *
 	 * @param ok the function that will be called if this future resolves
 	 * successfully. It is expected to return another future.
@@ -451,7 +604,7 @@ public:
 	inline
 	auto then(
 		/* We trust this to be something that is vaguely callable, and that
-		 * returns a shared_ptr-wrapped future. We use decltype and remove_reference
+		 * returns a future_ptr or shared_ptr-wrapped future. We use decltype and remove_reference
 		 * to tear the opaque U type apart, thus guaranteeing (*) that we'll
 		 * have a compilation failure if we get things wrong. Note that we
 		 * can't pass a std::function<> here, at least not easily, because then
@@ -459,142 +612,346 @@ public:
 		 */
 		U ok,
 		Args... err
-	) -> decltype(ok(T()))
+	) -> decltype(ok(std::declval<T>()))
 	{
 		/* We extract the type returned by the callback in stages, in a vain
 		 * attempt to make this code easier to read
 		 */
 
-		/** The shared_ptr<future<X>> type */
-		using future_ptr_type = decltype(ok(T()));
+		/** The future_ptr<X> or shared_ptr<future<X>> type */
+		using future_ptr_type = decltype(ok(std::declval<T>()));
 		/** The future<X> type */
 		using future_type = typename std::remove_reference<decltype(*(future_ptr_type().get()))>::type;
-		/** The X type, i.e. the type of the value held in the future */
-		using inner_type = decltype(future_type().value());
-		using return_type = decltype(ok(T()));
+		using return_type = decltype(ok(std::declval<T>()));
+		/** We can only tell whether the inner future is ours alone if we're not given a shared_ptr */
+		constexpr bool may_move = !std::is_same<return_type, std::shared_ptr<future_type>>::value;
+
+		/* If we're already done - a cache hit, say - the callback's future is
+		 * all the caller needs: no intermediate future, and no callbacks.
+		 */
+		if(is_done()) {
+			try {
+				return ok(get_ref());
+			} catch(...) {
+				return future_type::create_ptr()->fail_exception_pointer(std::current_exception());
+			}
+		}
+
+		/* Gather the parameter pack by mapping the disparate types through our callback handler.
+		 * These are move-only, so no initializer_list here, and a std::array rather than a
+		 * std::vector means they travel inside the task node without an allocation of their own.
+		 */
+		std::array<unique_function<return_type(const std::exception_ptr &)>, sizeof...(err)> items {{
+			exception_hoisting_callback(ok, std::move(err))...
+		}};
+
+		/* Likewise if we've already failed or been cancelled */
+		switch(current()) {
+		case state::failed:
+			try {
+				for(auto &it : items) {
+					if(auto inner = it(exception_ptr()))
+						return inner;
+				}
+			} catch(...) {
+				return future_type::create_ptr()->fail_exception_pointer(std::current_exception());
+			}
+			return future_type::create_ptr()->fail_from(*this);
+		case state::cancelled:
+			return future_type::create_ptr()->cancel();
+		default:
+			break;
+		}
 
 		/* This is what we'll return to the immediate caller: when the real future is
 		 * available, we'll propagate the result onto f.
 		 */
-		auto f = future_type::create_shared();
-
-		/* Gather the parameter pack by mapping the disparate types through our callback handler */
-		std::vector<std::function<return_type(const std::exception_ptr &)>> items {
-			exception_hoisting_callback(
-				ok,
-				err
-			)...
-		};
+		auto f = future_type::create_ptr();
 
-		call_when_ready([f, ok, items](future<T> &me) {
+		call_when_ready([f, ok = std::move(ok), items = std::move(items)](future<T, Policy> &me) mutable {
 			/* Either callback could throw an exception. That's fine - it's even encouraged,
 			 * since passing a future around to ->fail on is not likely to be much fun when
 			 * dealing with external APIs.
 			 */
 			try {
+				/* The caller may have cancelled f already, or may do so at any
+				 * point until we resolve it, so we only ever try to resolve it
+				 */
 				if(f->is_ready()) return;
 				if(me.is_done()) {
 					/* If we completed, call the function (exceptions will translate to f->fail)
 					 * and set up propagation */
 					// std::cout << "will call value in ->then handler for done status\n";
-					auto inner = ok(me.value());
-					inner->on_done([f](inner_type v) { f->done(v); })
-						->on_fail([f, inner](const std::string &) { f->fail_from(*inner); })
-						->on_cancel([f]() { f->cancel(); });
+					auto inner = ok(me.get_ref());
+					inner->forward_to(f, may_move);
 					/* TODO abandon vs. cancel */
-					f->on_cancel([inner]() { inner->cancel(); });
+					if(!inner->is_ready())
+						f->on_cancel([inner]() { inner->try_cancel(); });
 				} else if(me.is_failed()) {
 					/* The original future failed, so we try each exception handler in turn
 					 * until we find one that matches. We'll stop after the first match.
 					 */
 					for(auto &it : items) {
-						auto inner = it(me.ex_);
+						auto inner = it(me.exception_ptr());
 						if(inner) {
-							inner->on_done([f](inner_type v) { f->done(v); })
-								->on_fail([f, inner](const std::string &) { f->fail_from(*inner); })
-								->on_cancel([f]() { f->cancel(); });
+							inner->forward_to(f, may_move);
 							/* TODO abandon vs. cancel */
-							f->on_cancel([inner]() { inner->cancel(); });
+							if(!inner->is_ready())
+								f->on_cancel([inner]() { inner->try_cancel(); });
 							return;
 						}
 					}
 					/* No handler was available, so we'll stick with the original failure */
-					f->fail_from(me);
+					f->try_fail_from(me);
 				} else if(me.is_cancelled()) {
-					f->cancel();
+					f->try_cancel();
 				}
 			} catch(...) {
 				// std::cerr << "a wyld exception appears\n";
 				auto ex = std::current_exception();
-				f->fail_exception_pointer(ex);
+				f->try_fail_exception_pointer(ex);
 			}
 		});
 		return f;
 	}
 
-	std::shared_ptr<cps::future<T>>
-	fail_exception_pointer(const std::exception_ptr &ex)
+	/**
+	 * Maps our value through a function which returns a plain value
+	 * rather than a future, so there's no inner future to allocate:
+	 *
+	 *     auto len = f->transform([](const std::string &s) { return s.size(); });
+	 *
+	 * Failure and cancellation pass straight through, and an exception
+	 * from the function fails the result.
+	 */
+	template<typename F>
+	auto transform(
+		F code
+	) -> future_ptr<typename std::decay<decltype(code(std::declval<const T &>()))>::type, Policy>
 	{
-		return apply_state([&ex](future<T>&f) {
-			f.ex_ = ex;
+		using result_type = typename std::decay<decltype(code(std::declval<const T &>()))>::type;
+		auto result = future<result_type, Policy>::create_ptr();
+		call_when_ready([result, code = std::move(code)](future<T, Policy> &me) mutable {
+			/* No need to run the code if the result has been cancelled, but
+			 * that can still happen while it runs, hence the try_ forms
+			 */
+			if(result->is_ready()) return;
 			try {
-				std::rethrow_exception(ex);
-			} catch(const std::exception &e) {
-				f.failure_reason_ = e.what();
+				switch(me.current()) {
+				case state::done: result->try_done(code(me.get_ref())); break;
+				case state::failed: result->try_fail_from(me); break;
+				case state::cancelled: result->try_cancel(); break;
+				default: break;
+				}
 			} catch(...) {
-				f.failure_reason_ = "unknown";
+				result->try_fail_exception_pointer(std::current_exception());
 			}
+		});
+		return result;
+	}
+
+	/**
+	 * Starts a cps::chain from this future, for a series of transform
+	 * steps that only allocates one future at the end.
+	 */
+	cps::chain<T, Policy, detail::identity_stage> chain() {
+		return { ptr(), detail::identity_stage { } };
+	}
+
+	/**
+	 * The error counterpart to transform: if we fail, the function
+	 * provides a value instead. As with ->then error handlers, it can
+	 * take the failure reason as a string, or a specific exception type,
+	 * in which case other failures pass through untouched:
+	 *
+	 *     f->transform_error([](const std::string &) { return 0; });
+	 *     f->transform_error([](const std::out_of_range &) { return -1; });
+	 */
+	template<typename F>
+	future_ptr<T, Policy>
+	transform_error(F code)
+	{
+		using handles_string = is_string<
+			typename std::remove_pointer<decltype(arg_type_for(&F::operator()))>::type
+		>;
+		auto result = create_ptr();
+		call_when_ready([result, code = std::move(code)](future<T, Policy> &me) mutable {
+			/* As with transform, the result can be cancelled at any point */
+			if(result->is_ready()) return;
+			try {
+				switch(me.current()) {
+				case state::done: result->try_done(me.pass_value()); break;
+				case state::failed:
+					if(!recover(me, *result, code, std::integral_constant<bool, handles_string::value>()))
+						result->try_fail_from(me);
+					break;
+				case state::cancelled: result->try_cancel(); break;
+				default: break;
+				}
+			} catch(...) {
+				result->try_fail_exception_pointer(std::current_exception());
+			}
+		});
+		return result;
+	}
+
+	future_ptr<T, Policy>
+	fail_exception_pointer(const std::exception_ptr &ex)
+	{
+		return apply_state([&ex](future<T, Policy>&f) {
+			f.cold().ex = ex;
 		}, state::failed);
 	}
 
-	std::shared_ptr<future<T>>
+	future_ptr<T, Policy>
 	cancel() {
-		return apply_state([](future<T>&) {
+		return apply_state([](future<T, Policy>&) {
+		}, state::cancelled);
+	}
+
+	/*
+	 * The try_ forms resolve us in the same way, but if someone else
+	 * already has, they return false rather than throwing. They're for
+	 * code which can lose that race without it being a mistake - say,
+	 * a combinator whose result is cancelled while its inputs are still
+	 * finishing - since checking is_ready first leaves a window open.
+	 */
+
+	/** As done, returning false if we were already resolved */
+	bool try_done(T v)
+	{
+		return try_apply_state([&v](future<T, Policy>&f) {
+			f.value_.construct(std::move(v));
+		}, state::done);
+	}
+
+	/** As fail, returning false if we were already resolved */
+	template<
+		typename U,
+		typename std::enable_if<
+			is_string<U>::value,
+			bool
+		>::type * = nullptr
+	>
+	bool try_fail(const U ex)
+	{
+		return try_fail(std::runtime_error(ex));
+	}
+
+	/** As fail, returning false if we were already resolved */
+	template<
+		typename U,
+		typename std::enable_if<
+			!is_string<U>::value,
+			bool
+		>::type * = nullptr
+	>
+	bool try_fail(const U ex)
+	{
+		return try_apply_state([&ex](future<T, Policy>&f) {
+			f.cold().ex = std::make_exception_ptr(ex);
+		}, state::failed);
+	}
+
+	/** As fail_from, returning false if we were already resolved */
+	template<typename U, typename P>
+	bool try_fail_from(const cps::future<U, P> &f)
+	{
+		if(!f.is_failed())
+			throw std::logic_error("future is not failed");
+		return try_apply_state([&f](future<T, Policy>&me) {
+			me.cold().ex = f.exception_ptr();
+		}, state::failed);
+	}
+
+	/** As fail_exception_pointer, returning false if we were already resolved */
+	bool try_fail_exception_pointer(const std::exception_ptr &ex)
+	{
+		return try_apply_state([&ex](future<T, Policy>&f) {
+			f.cold().ex = ex;
+		}, state::failed);
+	}
+
+	/** As cancel, returning false if we were already resolved */
+	bool try_cancel()
+	{
+		return try_apply_state([](future<T, Policy>&) {
 		}, state::cancelled);
 	}
 
 	/** Returns true if this future is ready (this includes cancelled, failed and done) */
-	bool is_ready() const { return state_ != state::pending; }
+	bool is_ready() const { return current() != state::pending; }
 	/** Returns true if this future completed successfully */
-	bool is_done() const { return state_ == state::done; }
+	bool is_done() const { return current() == state::done; }
 	/** Returns true if this future has failed */
-	bool is_failed() const { return state_ == state::failed; }
+	bool is_failed() const { return current() == state::failed; }
 	/** Returns true if this future is cancelled */
-	bool is_cancelled() const { return state_ == state::cancelled; }
+	bool is_cancelled() const { return current() == state::cancelled; }
 	/** Returns true if this future is not yet ready */
-	bool is_pending() const { return state_ == state::pending; }
+	bool is_pending() const { return current() == state::pending; }
 
 	/**
-	 * Returns the failure reason (string) for this future.
+	 * Returns the failure reason (string) for this future. This is the
+	 * what() of our exception, worked out the first time it's needed.
 	 * @throws std::runtime_error if we are not yet ready or didn't fail
 	 */
 	const std::string &failure_reason() const {
-		if(state_ != state::failed)
+		if(current() != state::failed)
 			throw std::runtime_error("future is not failed");
-		return failure_reason_;
+		auto &c = cold();
+		auto reason = c.failure_reason.load(std::memory_order_acquire);
+		if(!reason) {
+			/* Another thread may get here at the same time, in which case
+			 * the first one to finish wins and everyone uses that copy
+			 */
+			std::unique_ptr<std::string> computed { new std::string(describe_exception(c.ex)) };
+			if(c.failure_reason.compare_exchange_strong(reason, computed.get(), std::memory_order_acq_rel))
+				reason = computed.release();
+		}
+		return *reason;
+	}
+
+	/**
+	 * Returns the what() string for the given exception, or "unknown" if
+	 * it isn't a std::exception.
+	 */
+	static std::string describe_exception(const std::exception_ptr &ex) {
+		if(!ex)
+			return "unknown";
+		try {
+			std::rethrow_exception(ex);
+		} catch(const std::exception &e) {
+			return e.what();
+		} catch(...) {
+			return "unknown";
+		}
 	}
 
 	/** Returns the label for this future */
-	const std::string &label() const { return label_; }
+	std::string label() const { return label_; }
+
+	/** The label used when we weren't given one */
+	static constexpr cps::label default_label() { return cps::label { "unlabelled future" }; }
+
 	/** Returns the exception pointer */
 	const std::exception_ptr &exception_ptr() const {
-		if(state_ != state::failed)
+		if(current() != state::failed)
 			throw std::runtime_error("future is not failed");
-		return ex_;
+		return cold().ex;
 	}
 
 	/**
 	 * Reports number of nanoseconds that have elapsed so far
 	 */
 	std::chrono::nanoseconds elapsed() const {
-		return (is_ready() ? resolved_ : std::chrono::high_resolution_clock::now()) - created_;
+		return timing_.elapsed(is_ready());
 	}
 
 	/**
 	 * Returns the current future state, as a string.
 	 */
 	std::string current_state() const {
-		return state_string(state_);
+		return state_string(current());
 	}
 
 	/**
@@ -602,11 +959,11 @@ public:
 	 */
 	static std::string state_string(state s) {
 		switch(s) {
-		case state::pending: return u8"pending";
-		case state::failed: return u8"failed";
-		case state::cancelled: return u8"cancelled";
-		case state::done: return u8"done";
-		default: return u8"unknown";
+		case state::pending: return "pending";
+		case state::failed: return "failed";
+		case state::cancelled: return "cancelled";
+		case state::done: return "done";
+		default: return "unknown";
 		}
 	}
 
@@ -631,10 +988,10 @@ public:
 			ss << ms.count() << "ms";
 		auto us = duration_cast<microseconds>(e -= ms);
 		if(us.count() != 0)
-			ss << us.count() << u8"µs";
+			ss << us.count() << "µs";
 		auto ns = duration_cast<nanoseconds>(e -= us);
 		if(ns.count() != 0)
-			ss << ns.count() << u8"ns";
+			ss << ns.count() << "ns";
 		return ss.str();
 	}
 
@@ -642,166 +999,664 @@ public:
 	 * Returns a string description of the current test, of the form:
 	 *
 	 *     Future label (done), 14ms234ns
+	 *
+	 * The time is left out if this future isn't being timed, see
+	 * CPS_FUTURE_TIMING.
 	 */
 	std::string describe() const {
-		return label_ + " (" + current_state() + "), " + time_string();
+		auto description = label() + " (" + current_state() + ")";
+		if(timing_.enabled())
+			description += ", " + time_string();
+		return description;
 	}
 
 protected:
 	/**
-	 * Queues the given function if we're not yet ready, otherwise
-	 * calls it immediately. Will obtain a lock during the
-	 * ready-or-queue check.
+	 * A single queued callback. These form an intrusive singly-linked
+	 * list hanging off state_, most recently added first.
 	 */
-	std::shared_ptr<future<T>>
-	call_when_ready(std::function<void(future<T> &)> code)
-	{
-		bool ready = false;
+	struct task {
+		task():next(nullptr) { }
+		virtual ~task() { }
+		/** Runs the callback */
+		virtual void run(future<T, Policy> &f) = 0;
+		/** Moves this callback into storage owned by another future */
+		virtual task *relocate(future<T, Policy> &dest) = 0;
+		/** Frees a task that isn't in one of our slots */
+		virtual void dispose() noexcept { delete this; }
+
+		task *next;
+	};
+
+	/** The concrete task for a given callable type */
+	template<typename F>
+	struct callback_task : public task {
+		explicit callback_task(
+			F code
+		):code(std::move(code))
+		{
+		}
+
+		void run(future<T, Policy> &f) override { code(f); }
+		task *relocate(future<T, Policy> &dest) override { return dest.make_task(std::move(code)); }
+
+		F code;
+	};
+
+	/** Raw storage for a task held directly inside the future */
+	using task_slot = typename std::aligned_storage<
+		CPS_FUTURE_INLINE_TASK_SIZE,
+		alignof(std::max_align_t)
+	>::type;
+
+	/**
+	 * state_ holds either a task list or a final state, never both:
+	 *
+	 * * pending - the head of the task list (possibly nullptr), with
+	 *   the claimed bit set once a resolver has started work
+	 * * done/failed/cancelled - the matching state value, no list, plus
+	 *   the taken bit once the value has been moved out
+	 *
+	 * Task nodes are at least 8-byte aligned, which leaves the low bits
+	 * free for this.
+	 */
+	static constexpr std::uintptr_t state_mask = 0x3;
+	static constexpr std::uintptr_t claimed_bit = 0x4;
+	/** Only used once resolved: set when someone has take()n our value */
+	static constexpr std::uintptr_t taken_bit = 0x8;
+	static constexpr std::uintptr_t task_mask = ~std::uintptr_t { 0x7 };
+	static_assert(alignof(task) >= 8, "task nodes need 3 spare bits");
+	static_assert(alignof(task_slot) >= 8, "task slots need 3 spare bits");
+	static_assert(static_cast<std::uintptr_t>(state::cancelled) <= state_mask, "state must fit in the tag bits");
+
+	/** Extracts the state from a raw state_ value */
+	static state state_from(std::uintptr_t v) { return static_cast<state>(v & state_mask); }
+	/** Extracts the task list from a raw state_ value */
+	static task *task_list(std::uintptr_t v) { return (v & state_mask) ? nullptr : reinterpret_cast<task *>(v & task_mask); }
+	/** The parts of a raw state_ value which survive a copy or move: everything except the task list */
+	static std::uintptr_t resolved_bits(std::uintptr_t v) { return (v & state_mask) ? v : 0; }
+
+	/** Current state, with acquire semantics so that a ready state implies visible results */
+	state current() const { return state_from(state_.load(std::memory_order_acquire)); }
+
+	/** A task which didn't fit in our slots, allocated from an arena */
+	template<typename F>
+	struct arena_task : public callback_task<F> {
+		arena_task(
+			const arena_allocator<arena_task> &alloc,
+			F code
+		):callback_task<F>(std::move(code)),
+		  alloc(alloc)
 		{
-			std::lock_guard<std::mutex> guard { mutex_ };
-			ready = state_ != state::pending;
-			if(!ready) {
-				tasks_.push_back(code);
+		}
+
+		void dispose() noexcept override {
+			auto a = alloc;
+			this->~arena_task();
+			a.deallocate(this, 1);
+		}
+
+		arena_allocator<arena_task> alloc;
+	};
+
+	/**
+	 * Wraps a callback in a task node. The first few go into our own
+	 * task slots, anything beyond that (or too large to fit) goes in
+	 * the current arena, or on the heap if there isn't one. Slots are
+	 * handed out once and never reused: after we resolve, callbacks run
+	 * immediately and don't need a node.
+	 */
+	template<typename F>
+	task *make_task(F code)
+	{
+		using node = callback_task<F>;
+		if(sizeof(node) <= sizeof(task_slot) && alignof(node) <= alignof(task_slot)) {
+			const auto idx = slots_used_.load(std::memory_order_relaxed) < slots_.size()
+				? slots_used_.fetch_add(1, std::memory_order_relaxed)
+				: slots_.size();
+			if(idx < slots_.size())
+				return new (&slots_[idx]) node(std::move(code));
+		}
+		if(auto a = arena::current())
+			return detail::arena_new<arena_task<F>>(*a, std::move(code));
+		return new node(std::move(code));
+	}
+
+	/** True if this task lives in one of our slots rather than on the heap */
+	bool is_inline(const task *t) const {
+		return !slots_.empty()
+			&& std::less_equal<const void *>()(&slots_.front(), t)
+			&& std::less_equal<const void *>()(t, &slots_.back());
+	}
+
+	/** Destroys a single task node, wherever it lives */
+	void release_task(task *t) {
+		if(is_inline(t))
+			t->~task();
+		else
+			t->dispose();
+	}
+
+	/** Releases every node in a task list without running anything */
+	void destroy_tasks(task *t) {
+		while(t) {
+			auto next = t->next;
+			release_task(t);
+			t = next;
+		}
+	}
+
+	/**
+	 * Runs and releases every node in a detached task list. The list is
+	 * newest-first, so we reverse it to preserve registration order.
+	 */
+	void run_tasks(task *t) {
+		task *ordered = nullptr;
+		while(t) {
+			auto next = t->next;
+			t->next = ordered;
+			ordered = t;
+			t = next;
+		}
+		while(ordered) {
+			auto current = ordered;
+			ordered = ordered->next;
+			try {
+				current->run(*this);
+			} catch(...) {
+				release_task(current);
+				destroy_tasks(ordered);
+				throw;
 			}
+			release_task(current);
 		}
-		if(ready) code(*this);
-		return shared();
 	}
 
 	/**
-	 * Removes an existing callback from the list, if we have one.
+	 * Queues the given function if we're not yet ready, otherwise
+	 * calls it immediately. Never blocks: the task is pushed onto
+	 * the list with a CAS, which fails if a resolver has detached the
+	 * list in the meantime.
 	 */
-	std::shared_ptr<future<T>>
-	remove_callback(std::function<void(future<T> &)> &code)
+	template<typename F>
+	future_ptr<T, Policy>
+	call_when_ready(F code)
 	{
-		std::lock_guard<std::mutex> guard { mutex_ };
-		tasks_.erase(
-			std::remove_if(
-				begin(tasks_),
-				end(tasks_),
-				[&code](const std::function<void(future<T> &)> &it) { return code == it; }
-			)
-		);
-		return shared();
+		task *t = nullptr;
+		auto current = state_.load(std::memory_order_acquire);
+		while(!(current & state_mask)) {
+			if(!t) t = make_task(std::move(code));
+			t->next = task_list(current);
+			const auto head = reinterpret_cast<std::uintptr_t>(t) | (current & claimed_bit);
+			if(state_.compare_exchange_weak(current, head, std::memory_order_release, std::memory_order_acquire))
+				return ptr();
+		}
+		if(t) {
+			t->next = nullptr;
+			run_tasks(t);
+		} else {
+			code(*this);
+		}
+		return ptr();
 	}
 
 	/**
 	 * Runs the given code then updates the state.
+	 *
+	 * The claimed bit gives the caller exclusive rights to write our
+	 * result; the final exchange publishes that result and detaches
+	 * the task list in one step, so anything registered before it is
+	 * ours to run and anything after will see the new state.
 	 */
-	std::shared_ptr<future<T>> apply_state(std::function<void(future<T>&)> code, state s)
+	template<typename F>
+	future_ptr<T, Policy> apply_state(F code, state s)
+	{
+		if(!try_apply_state(std::move(code), s))
+			throw std::logic_error("tried to resolve future twice, wanted " + state_string(s) + ":" + describe());
+		return ptr();
+	}
+
+	/**
+	 * As apply_state, but returns false without running the code if
+	 * we're already resolved, or someone else is busy resolving us.
+	 */
+	template<typename F>
+	bool try_apply_state(F code, state s)
 	{
 		/* Cannot change state to pending, since we assume that we want
 		 * to call all deferred tasks.
 		 */
 		assert(s != state::pending);
 
-		std::vector<std::function<void(future<T> &)>> pending { };
-		{
-			std::lock_guard<std::mutex> guard { mutex_ };
-			if(state_ != state::pending)
-				throw std::logic_error("tried to resolve future twice, wanted " + state_string(s) + ":" + describe());
+		auto current = state_.load(std::memory_order_acquire);
+		do {
+			if(current & (state_mask | claimed_bit))
+				return false;
+		} while(!state_.compare_exchange_weak(current, current | claimed_bit, std::memory_order_acquire));
 
+		try {
 			code(*this);
-			pending = std::move(tasks_);
-			tasks_.clear();
-			/* This must happen last */
+		} catch(...) {
+			state_.fetch_and(~claimed_bit, std::memory_order_release);
+			throw;
+		}
+		timing_.resolved();
+		/* This must happen last */
+		current = state_.exchange(static_cast<std::uintptr_t>(s), std::memory_order_acq_rel);
+		dispatch_tasks(task_list(current));
+		return true;
+	}
 
-			resolved_ = std::chrono::high_resolution_clock::now();
-			state_ = s;
-			/* Might want to consider something like compare_exchange_strong(...) if we need a mutex-free version in future:? */
+	/**
+	 * Runs the task list detached by apply_state, unless we're already
+	 * deep inside other futures' callbacks on this thread - then it's
+	 * queued for the outermost one to run, see detail::trampoline.
+	 *
+	 * Only futures owned through handles get queued, since a reference
+	 * is all that keeps us alive until the queue gets to us. One on the
+	 * stack or in a unique_ptr could be gone by then, so those always
+	 * run their callbacks inline, however deep we are.
+	 */
+	void dispatch_tasks(task *t)
+	{
+		if(!t)
+			return;
+		if(owned_by_handles_ && detail::trampoline::should_defer()) {
+			add_ref();
+			detail::trampoline::defer(&run_deferred, this, t);
+			return;
+		}
+		detail::trampoline::enter();
+		try {
+			run_tasks(t);
+		} catch(...) {
+			detail::trampoline::leave_unwinding();
+			throw;
 		}
-		for(auto &v : pending) {
-			v(*this);
+		detail::trampoline::leave();
+	}
+
+	/** Runs a queued task list, dropping the reference dispatch_tasks took for it */
+	static void run_deferred(void *owner, void *tasks)
+	{
+		future_ptr<T, Policy> me { static_cast<future<T, Policy> *>(owner), typename future_ptr<T, Policy>::adopt_t { } };
+		me->run_tasks(static_cast<task *>(tasks));
+	}
+
+	/**
+	 * Takes over the task list from another future, leaving its state intact.
+	 * Tasks held in the other future's slots are moved into ours.
+	 */
+	void steal_tasks(future<T, Policy> &src)
+	{
+		auto current = src.state_.load(std::memory_order_acquire);
+		while(!src.state_.compare_exchange_weak(current, resolved_bits(current), std::memory_order_acq_rel)) { }
+		task *head = nullptr;
+		task **tail = &head;
+		for(auto t = task_list(current); t; ) {
+			auto next = t->next;
+			if(src.is_inline(t)) {
+				*tail = t->relocate(*this);
+				src.release_task(t);
+			} else {
+				*tail = t;
+			}
+			tail = &(*tail)->next;
+			t = next;
 		}
-		return shared();
+		*tail = nullptr;
+		state_.fetch_or(reinterpret_cast<std::uintptr_t>(head), std::memory_order_release);
 	}
 
 //#if CAN_COPY_FUTURES
 	/**
 	 * Locked constructor for internal use.
 	 * Copies from the source instance, protected by the given mutex.
+	 * Pending callbacks stay with the original: copying them would
+	 * mean they could fire more than once.
 	 */
 	future(
-		const future<T> &src,
-		const std::lock_guard<std::mutex> &
-	):state_(src.state_.load()),
-	  weak_ptr_(src.weak_ptr_),
-	  tasks_(src.tasks_),
-	  ex_(src.ex_),
+		const future<T, Policy> &src,
+		const std::lock_guard<typename Policy::mutex> &
+	):refs_(1),
+	  slots_used_(0),
+	  owned_by_handles_(false),
+	  state_(resolved_bits(src.state_.load(std::memory_order_acquire))),
+	  cold_(nullptr),
 	  label_(src.label_),
-	  created_(src.created_),
-	  resolved_(src.resolved_),
-	  value_(src.value_)
+	  timing_(src.timing_)
 	{
+		if(is_done())
+			value_.construct(src.value_.get());
+		if(auto from = src.cold_.load(std::memory_order_acquire)) {
+			auto &c = cold();
+			c.label = from->label;
+			c.ex = from->ex;
+			if(label_ == from->label.c_str())
+				label_ = c.label.c_str();
+			if(auto reason = from->failure_reason.load(std::memory_order_acquire))
+				c.failure_reason.store(new std::string(*reason), std::memory_order_release);
+		}
 	}
 //#endif
 
 	/**
 	 * Locked move constructor, for internal use.
+	 *
+	 * The source keeps its cold block, since the lock we're holding may
+	 * live there. We take its label, if it owns one, and share its
+	 * exception, so a failed future stays failed once moved from.
 	 */
 	future(
-		future<T> &&src,
-		const std::lock_guard<std::mutex> &
-	) noexcept
-	 :state_(std::move(src.state_)),
-	  weak_ptr_(std::move(src.weak_ptr_)),
-	  tasks_(std::move(src.tasks_)),
-	  ex_(src.ex_),
-	  label_(std::move(src.label_)),
-	  created_(std::move(src.created_)),
-	  resolved_(std::move(src.resolved_)),
-	  value_(std::move(src.value_))
+		future<T, Policy> &&src,
+		const std::lock_guard<typename Policy::mutex> &
+	):refs_(1),
+	  slots_used_(0),
+	  owned_by_handles_(false),
+	  state_(resolved_bits(src.state_.load(std::memory_order_acquire))),
+	  cold_(nullptr),
+	  label_(src.label_),
+	  timing_(src.timing_)
 	{
+		/* Allocate before touching src, so that if this throws, src is intact */
+		if(auto from = src.cold_.load(std::memory_order_acquire)) {
+			const bool owns_label = src.label_ == from->label.c_str();
+			if(owns_label || from->ex) {
+				auto &c = cold();
+				/* The failure reason can be worked out again from this if anyone asks */
+				c.ex = from->ex;
+				if(owns_label) {
+					c.label = std::move(from->label);
+					label_ = c.label.c_str();
+					src.label_ = default_label().c_str();
+				}
+			}
+		}
+		if(is_done())
+			value_.construct(std::move(src.value_.get()));
+		steal_tasks(src);
 	}
 
+	friend class future_ptr<T, Policy>;
+	template<typename, typename> friend class future;
+
+	/**
+	 * Hands our value on to the next future in a chain: a copy if T
+	 * allows that, otherwise we have no choice but to move it out.
+	 */
+	T pass_value() { return pass_value(std::is_copy_constructible<T>()); }
+	T pass_value(std::true_type) { return get_ref(); }
+	T pass_value(std::false_type) { return take(); }
+
+	/** transform_error with a handler taking the failure reason: always handles it */
+	template<typename F>
+	static bool recover(future<T, Policy> &me, future<T, Policy> &result, F &code, std::true_type) {
+		result.try_done(code(me.failure_reason()));
+		return true;
+	}
+
+	/** transform_error with a handler for a specific exception type: only handles that */
+	template<typename F>
+	static bool recover(future<T, Policy> &me, future<T, Policy> &result, F &code, std::false_type) {
+		using exception_type = typename std::remove_pointer<decltype(arg_type_for(&F::operator()))>::type;
+		try {
+			std::rethrow_exception(me.exception_ptr());
+		} catch(const exception_type &e) {
+			result.try_done(code(e));
+			return true;
+		} catch(...) {
+		}
+		return false;
+	}
+
+	/** Calls a handler with the future if it wants it, otherwise with no arguments */
+	template<typename F>
+	static void call_with_future(F &code, future<T, Policy> &f, std::true_type) { code(f); }
+	template<typename F>
+	static void call_with_future(F &code, future<T, Policy> &, std::false_type) { code(); }
+
+	/**
+	 * Copies our result - done, failed or cancelled - to another future
+	 * once we have one, using a single callback. If the target has
+	 * already been resolved by then, or is cancelled while we're busy,
+	 * we leave it alone.
+	 *
+	 * If may_move is set and nothing else holds a reference to us at
+	 * that point, nobody else can see our value either, so it's moved
+	 * rather than copied. Only set it when every handle is a future_ptr:
+	 * copies of a std::shared_ptr from shared() all share one reference.
+	 *
+	 * In practice, only a future which was already resolved when we got
+	 * it is moved. One that's still pending is held by whoever resolves
+	 * it later, who may want the value afterwards - and by ->then's
+	 * cancellation link - so its value is always copied.
+	 */
+	void
+	forward_to(future_ptr<T, Policy> target, bool may_move)
+	{
+		call_when_ready([target = std::move(target), may_move](future<T, Policy> &in) {
+			/* The target can still be cancelled after this, so we only try to resolve it */
+			if(target->is_ready())
+				return;
+			switch(in.current()) {
+			case state::done:
+				target->try_done(may_move && in.use_count() == 1 ? in.take() : in.pass_value());
+				break;
+			case state::failed:
+				target->try_fail_from(in);
+				break;
+			case state::cancelled:
+				target->try_cancel();
+				break;
+			default:
+				break;
+			}
+		});
+	}
+
+	/** Adds a reference, see future_ptr */
+	void add_ref() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+	/** Drops a reference, and cleans up if that was the last one */
+	void release() {
+		if(refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			destroy();
+	}
+
+	/** Frees a future created by create_ptr, see detail::allocated_future for the allocator version */
+	virtual void destroy() { delete this; }
+
+	/**
+	 * Everything we only need occasionally - on failure, for futures
+	 * with a std::string label, or when copying/moving - lives in a separate block which
+	 * is only allocated once something needs it. This keeps the fields
+	 * touched on every future together at the start of the object.
+	 */
+	struct cold_data {
+		cold_data():failure_reason(nullptr) { }
+		virtual ~cold_data() { delete failure_reason.load(std::memory_order_acquire); }
+
+		/** Frees this block, wherever it came from */
+		virtual void dispose() noexcept { delete this; }
+
+		/** Guard variable for copy and move construction, unless we're using a lock pool */
+		typename std::conditional<
+			Policy::lock_stripes == 0,
+			typename Policy::mutex,
+			detail::null_mutex
+		>::type mutex;
+		/** Our copy of the label, if we were given a std::string */
+		std::string label;
+		/** The exception, if we failed */
+		std::exception_ptr ex;
+		/** The exception as a string, if we failed and someone has asked for it (see failure_reason()) */
+		typename Policy::template atomic<std::string *> failure_reason;
+	};
+
+	/** Cold data allocated from an arena, see make_cold() */
+	struct arena_cold_data : public cold_data {
+		explicit arena_cold_data(
+			const arena_allocator<arena_cold_data> &alloc
+		):alloc(alloc)
+		{
+		}
+
+		void dispose() noexcept override {
+			auto a = alloc;
+			this->~arena_cold_data();
+			a.deallocate(this, 1);
+		}
+
+		arena_allocator<arena_cold_data> alloc;
+	};
+
+	/** A new cold block, from the current arena if there is one */
+	static cold_data *make_cold() {
+		if(auto a = arena::current())
+			return detail::arena_new<arena_cold_data>(*a);
+		return new cold_data();
+	}
+
+	/**
+	 * Returns our cold data, allocating it on first use. Safe to call
+	 * from multiple threads: if two race, one allocation wins and the
+	 * other is discarded.
+	 */
+	cold_data &cold() const {
+		auto c = cold_.load(std::memory_order_acquire);
+		if(!c) {
+			auto created = make_cold();
+			if(cold_.compare_exchange_strong(c, created, std::memory_order_acq_rel))
+				c = created;
+			else
+				created->dispose();
+		}
+		return *c;
+	}
+
+	/** The lock held while copying or moving from this future */
+	typename Policy::mutex &construction_lock() const {
+		return construction_lock(std::integral_constant<bool, (Policy::lock_stripes > 0)>());
+	}
+
+	typename Policy::mutex &construction_lock(std::false_type) const { return cold().mutex; }
+	typename Policy::mutex &construction_lock(std::true_type) const { return Policy::lock_for(this); }
+
 protected:
-	/** Guard variable for serialising updates to the tasks_ member */
-	mutable std::mutex mutex_;
-	/** Current future state. Atomic so we can get+set from multiple threads without needing a full lock */
-	std::atomic<state> state_;
-	/** Track current shared_ptr, for cases where we act as a shared_ptr (i.e. most of the time) */
-	mutable std::weak_ptr<future<T>> weak_ptr_;
-	/** The list of tasks to run when we are resolved */
-	std::vector<std::function<void(future<T> &)>> tasks_;
-	/** The final value of the future, if we completed successfully */
-	T value_;
-	/** The exception as a string, if we failed */
-	std::string failure_reason_;
-	/** The exception, if we failed */
-	std::exception_ptr ex_;
-	/** Label for this future */
-	std::string label_;
-	/** When we were created */
-	checkpoint created_;
-	/** When we were marked ready */
-	checkpoint resolved_;
+	/**
+	 * Number of handles to this future. Starts at 1, which belongs to
+	 * whoever constructed us: create_ptr hands that reference to its
+	 * future_ptr, whereas a future on the stack or in a unique_ptr
+	 * never gives it up, so handles can't end up deleting it.
+	 */
+	typename Policy::template atomic<std::uint32_t> refs_;
+	/** Number of task slots handed out so far */
+	typename Policy::template atomic<std::uint16_t> slots_used_;
+	/**
+	 * True once a future_ptr has adopted the reference we started with,
+	 * as create_ptr does: from then on references decide our lifetime,
+	 * so holding one is enough to keep us around.
+	 */
+	bool owned_by_handles_;
+	/**
+	 * Current future state and pending task list, see state_mask. Atomic so we can
+	 * register and resolve from multiple threads without needing a lock.
+	 */
+	typename Policy::template atomic<std::uintptr_t> state_;
+	/** Rarely-used fields, see cold_data */
+	mutable typename Policy::template atomic<cold_data *> cold_;
+	/** Label for this future: either static, or pointing into cold_data::label */
+	const char *label_;
+	/** Creation and resolution times, if we're keeping them */
+	detail::timing<CPS_FUTURE_TIMING> timing_;
+	/** The final value of the future, only constructed once we complete successfully */
+	detail::uninitialized<T> value_;
+	/** Inline storage for the first few tasks, so that we can avoid allocating for them */
+	std::array<task_slot, CPS_FUTURE_INLINE_TASKS> slots_;
 };
 
-template<
-	typename T
->
-std::shared_ptr<future<T>>
-resolved_future(T v)
+namespace detail {
+
+/**
+ * A future which remembers the allocator it came from, so it can give
+ * the memory back when the last handle is released.
+ */
+template<typename Future, typename Alloc>
+class allocated_future : public Future {
+public:
+	using allocator_type = typename std::allocator_traits<Alloc>::template rebind_alloc<allocated_future>;
+
+	template<typename... Label>
+	allocated_future(
+		const allocator_type &alloc,
+		Label &&... label
+	):Future(std::forward<Label>(label)...),
+	  alloc_(alloc)
+	{
+	}
+
+protected:
+	void destroy() override {
+		allocator_type alloc { alloc_ };
+		this->~allocated_future();
+		std::allocator_traits<allocator_type>::deallocate(alloc, this, 1);
+	}
+
+private:
+	allocator_type alloc_;
+};
+
+/**
+ * Creates a Future - cps::future itself, or a subclass carrying some
+ * extra state alongside - the way future::create_ptr does, so it comes
+ * from the current arena if there is one.
+ */
+template<typename Future, typename... Label, typename>
+future_ptr<typename Future::value_type, typename Future::policy_type> create_as(Label &&... label)
 {
-	return future<T>::create_shared()->done(v);
+	using ptr_type = future_ptr<typename Future::value_type, typename Future::policy_type>;
+	if(auto a = arena::current())
+		return create_as<Future>(std::allocator_arg, arena_allocator<Future>(*a), std::forward<Label>(label)...);
+	return ptr_type(new Future(std::forward<Label>(label)...), typename ptr_type::adopt_t { });
+}
+
+/** As above, with memory from the given allocator, which is also used to free it */
+template<typename Future, typename Alloc, typename... Label>
+future_ptr<typename Future::value_type, typename Future::policy_type> create_as(std::allocator_arg_t, const Alloc &alloc, Label &&... label)
+{
+	using ptr_type = future_ptr<typename Future::value_type, typename Future::policy_type>;
+	using allocated = allocated_future<Future, Alloc>;
+	using traits = std::allocator_traits<typename allocated::allocator_type>;
+	typename allocated::allocator_type a { alloc };
+	auto p = traits::allocate(a, 1);
+	try {
+		::new(static_cast<void *>(p)) allocated(a, std::forward<Label>(label)...);
+	} catch(...) {
+		traits::deallocate(a, p, 1);
+		throw;
+	}
+	return ptr_type(p, typename ptr_type::adopt_t { });
+}
+
 }
 
 template<
 	typename T
 >
-std::shared_ptr<future<T>>
-make_future()
+future_ptr<T>
+resolved_future(T v)
 {
-	return future<T>::create_shared();
+	return future<T>::create_ptr()->done(std::move(v));
 }
 
 template<
-	typename T
+	typename T,
+	typename... Label
 >
-std::shared_ptr<future<T>>
-make_future(const std::string &label)
+future_ptr<T>
+make_future(Label &&... label)
 {
-	return future<T>::create_shared(label);
+	return future<T>::create_ptr(std::forward<Label>(label)...);
 }
 
 };
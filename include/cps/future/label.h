@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+namespace cps {
+
+/**
+ * A label for a future which lives at least as long as the future
+ * does, so the future only needs to keep the pointer. You get one
+ * of these from a string literal via operator""_label, or from
+ * intern_label() for strings built at runtime.
+ */
+class label {
+public:
+	/**
+	 * The text must outlive every future using this label - prefer
+	 * operator""_label or intern_label() over calling this directly.
+	 */
+	constexpr explicit label(
+		const char *text
+	) noexcept
+	 :text_(text)
+	{
+	}
+
+	constexpr const char *c_str() const noexcept { return text_; }
+
+private:
+	const char *text_;
+};
+
+/**
+ * Returns a label for the given string, which stays valid for the
+ * lifetime of the program. Each distinct string is stored once, so
+ * this is best kept for a limited set of labels - anything with a
+ * request ID in it would be better off passed as a std::string.
+ */
+inline label
+intern_label(const std::string &text)
+{
+	static std::mutex mutex;
+	static std::unordered_set<std::string> labels;
+	std::lock_guard<std::mutex> guard { mutex };
+	return label { labels.insert(text).first->c_str() };
+}
+
+namespace literals {
+
+/** Turns a string literal into a label: make_future<int>("fetch"_label) */
+constexpr label operator"" _label(const char *text, std::size_t) noexcept { return label { text }; }
+
+}
+
+};
+
@@ -0,0 +1,204 @@
+#pragma once
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <cps/future.h>
+
+namespace cps {
+
+namespace detail {
+
+/**
+ * Passes whatever produce() returns to the receiver, or the exception if
+ * it throws. Exceptions from the receiver itself are left to propagate.
+ */
+template<typename Receiver, typename G>
+void deliver(Receiver &receiver, G &&produce)
+{
+	using result_type = typename std::decay<decltype(produce())>::type;
+	uninitialized<result_type> result;
+	try {
+		result.construct(produce());
+	} catch(...) {
+		receiver.set_error(std::current_exception());
+		return;
+	}
+	try {
+		receiver.set_value(std::move(result.get()));
+	} catch(...) {
+		result.destroy();
+		throw;
+	}
+	result.destroy();
+}
+
+/** Starts a lazy_value */
+template<typename T>
+struct lazy_just {
+	T value;
+
+	template<typename Receiver>
+	void operator()(Receiver receiver) { receiver.set_value(std::move(value)); }
+};
+
+/** Starts a lazy_call: the function runs here, and if it throws, that's our error */
+template<typename F>
+struct lazy_invoke {
+	F code;
+
+	template<typename Receiver>
+	void operator()(Receiver receiver) { deliver(receiver, code); }
+};
+
+/** Starts a lazy_from: waits on an existing future */
+template<typename T, typename Policy>
+struct lazy_wait {
+	future_ptr<T, Policy> source;
+
+	template<typename Receiver>
+	void operator()(Receiver receiver) {
+		source->on_ready([receiver = std::move(receiver)](cps::future<T, Policy> &me) mutable {
+			if(me.is_done())
+				receiver.set_value(pass(me, std::is_copy_constructible<T>()));
+			else if(me.is_failed())
+				receiver.set_error(me.exception_ptr());
+			else
+				receiver.set_cancelled();
+		});
+	}
+
+	/** Someone else may still want the value, so we only take it if we can't copy it */
+	static T pass(cps::future<T, Policy> &me, std::true_type) { return me.value(); }
+	static T pass(cps::future<T, Policy> &me, std::false_type) { return me.take(); }
+};
+
+/** Passes values through a function on their way to the next receiver */
+template<typename Receiver, typename F>
+struct transform_receiver {
+	Receiver next;
+	F code;
+
+	template<typename V>
+	void set_value(V &&v) {
+		const typename std::decay<V>::type &value = v;
+		deliver(next, [this, &value] { return code(value); });
+	}
+	void set_error(std::exception_ptr ex) { next.set_error(std::move(ex)); }
+	void set_cancelled() { next.set_cancelled(); }
+};
+
+/** Starts a transformed lazy: starts the original, with our function in front of the receiver */
+template<typename Start, typename F>
+struct lazy_transform {
+	Start start;
+	F code;
+
+	template<typename Receiver>
+	void operator()(Receiver receiver) {
+		start(transform_receiver<Receiver, F> { std::move(receiver), std::move(code) });
+	}
+};
+
+/**
+ * Receiver resolving a classic future, used by lazy::future. If the
+ * caller has cancelled the future by the time the outcome arrives -
+ * or does so while it's arriving - the outcome is dropped.
+ */
+template<typename T, typename Policy>
+struct future_receiver {
+	future_ptr<T, Policy> target;
+
+	template<typename V>
+	void set_value(V &&v) { target->try_done(std::forward<V>(v)); }
+	void set_error(std::exception_ptr ex) { target->try_fail_exception_pointer(ex); }
+	void set_cancelled() { target->try_cancel(); }
+};
+
+}
+
+/**
+ * A description of some work that hasn't started yet: a cold future.
+ *
+ * Unlike cps::future, a lazy is a plain value. Building a pipeline out
+ * of lazy_value, lazy_call and transform allocates nothing and runs
+ * nothing - each step just wraps the one before it. Work starts when
+ * the pipeline is handed a receiver with start(), converted into a
+ * classic future with future(), or - in C++20 - awaited with co_await,
+ * see coroutine.h:
+ *
+ *     auto len = lazy_call([] { return read_config(); })
+ *         .transform([](const std::string &s) { return s.size(); })
+ *         .future();
+ *
+ * A receiver is any object with these members, exactly one of which is
+ * called, once:
+ *
+ *     void set_value(T);
+ *     void set_error(std::exception_ptr);
+ *     void set_cancelled();
+ *
+ * Start is the callable which does the work when given a receiver; it's
+ * an implementation detail, so use auto for the full type.
+ */
+template<typename T, typename Start>
+class lazy {
+public:
+	using value_type = T;
+
+	explicit lazy(Start start):start_(std::move(start)) { }
+
+	/** Runs the pipeline, delivering the outcome to the given receiver */
+	template<typename Receiver>
+	void start(Receiver receiver) && { start_(std::move(receiver)); }
+
+	/** Adds a step which maps the value to a plain value, as with future::transform */
+	template<typename F>
+	auto transform(F code) && -> lazy<typename std::decay<decltype(code(std::declval<const T &>()))>::type, detail::lazy_transform<Start, F>> {
+		using result_type = typename std::decay<decltype(code(std::declval<const T &>()))>::type;
+		return lazy<result_type, detail::lazy_transform<Start, F>>(
+			detail::lazy_transform<Start, F> { std::move(start_), std::move(code) }
+		);
+	}
+
+	/**
+	 * Starts the pipeline, returning a classic future for the outcome.
+	 * This is the only allocation a lazy pipeline makes.
+	 */
+	template<typename Policy = default_thread_policy>
+	future_ptr<T, Policy> future() && {
+		auto f = cps::future<T, Policy>::create_ptr();
+		start_(detail::future_receiver<T, Policy> { f });
+		return f;
+	}
+
+private:
+	Start start_;
+};
+
+/** A lazy which delivers the given value */
+template<typename T>
+inline lazy<typename std::decay<T>::type, detail::lazy_just<typename std::decay<T>::type>>
+lazy_value(T &&value)
+{
+	using value_type = typename std::decay<T>::type;
+	return lazy<value_type, detail::lazy_just<value_type>>(detail::lazy_just<value_type> { std::forward<T>(value) });
+}
+
+/** A lazy which calls the given function when started, delivering its result or exception */
+template<typename F>
+inline auto lazy_call(F code) -> lazy<typename std::decay<decltype(code())>::type, detail::lazy_invoke<F>>
+{
+	using value_type = typename std::decay<decltype(code())>::type;
+	return lazy<value_type, detail::lazy_invoke<F>>(detail::lazy_invoke<F> { std::move(code) });
+}
+
+/** A lazy which waits for an existing future, for mixing the two styles */
+template<typename T, typename Policy>
+inline lazy<T, detail::lazy_wait<T, Policy>>
+lazy_from(future_ptr<T, Policy> source)
+{
+	return lazy<T, detail::lazy_wait<T, Policy>>(detail::lazy_wait<T, Policy> { std::move(source) });
+}
+
+};
+
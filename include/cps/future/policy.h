@@ -0,0 +1,171 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace cps {
+
+namespace detail {
+
+/**
+ * Stand-in for std::atomic, for data that never leaves the thread that
+ * created it. Same interface as the parts of std::atomic we use, but
+ * with plain loads and stores underneath.
+ */
+template<typename U>
+class plain_atomic {
+public:
+	plain_atomic(
+		U v = U()
+	) noexcept
+	 :value_(v)
+	{
+	}
+
+	plain_atomic(const plain_atomic &) = delete;
+	plain_atomic &operator=(const plain_atomic &) = delete;
+
+	U load(std::memory_order = std::memory_order_seq_cst) const noexcept { return value_; }
+	void store(U v, std::memory_order = std::memory_order_seq_cst) noexcept { value_ = v; }
+
+	U fetch_add(U v, std::memory_order = std::memory_order_seq_cst) noexcept {
+		const U previous = value_;
+		value_ += v;
+		return previous;
+	}
+
+	U fetch_sub(U v, std::memory_order = std::memory_order_seq_cst) noexcept {
+		const U previous = value_;
+		value_ -= v;
+		return previous;
+	}
+
+	U fetch_and(U v, std::memory_order = std::memory_order_seq_cst) noexcept {
+		const U previous = value_;
+		value_ &= v;
+		return previous;
+	}
+
+	U fetch_or(U v, std::memory_order = std::memory_order_seq_cst) noexcept {
+		const U previous = value_;
+		value_ |= v;
+		return previous;
+	}
+
+	U exchange(U v, std::memory_order = std::memory_order_seq_cst) noexcept {
+		const U previous = value_;
+		value_ = v;
+		return previous;
+	}
+
+	/** Never fails spuriously, so weak and strong are the same thing */
+	bool compare_exchange_strong(U &expected, U desired, std::memory_order = std::memory_order_seq_cst, std::memory_order = std::memory_order_seq_cst) noexcept {
+		if(value_ != expected) {
+			expected = value_;
+			return false;
+		}
+		value_ = desired;
+		return true;
+	}
+
+	bool compare_exchange_weak(U &expected, U desired, std::memory_order success = std::memory_order_seq_cst, std::memory_order failure = std::memory_order_seq_cst) noexcept {
+		return compare_exchange_strong(expected, desired, success, failure);
+	}
+
+private:
+	U value_;
+};
+
+/**
+ * Stand-in for std::mutex when there's only one thread: locking
+ * does nothing.
+ */
+struct null_mutex {
+	void lock() noexcept { }
+	bool try_lock() noexcept { return true; }
+	void unlock() noexcept { }
+};
+
+/**
+ * A spinlock with a cache line to itself, so that neighbouring locks
+ * in a lock_pool don't share lines. Only suitable for locks that are
+ * held very briefly.
+ */
+class alignas(64) spinlock {
+public:
+	spinlock() noexcept { flag_.clear(); }
+	spinlock(const spinlock &) = delete;
+	spinlock &operator=(const spinlock &) = delete;
+
+	void lock() noexcept { while(flag_.test_and_set(std::memory_order_acquire)) { } }
+	bool try_lock() noexcept { return !flag_.test_and_set(std::memory_order_acquire); }
+	void unlock() noexcept { flag_.clear(std::memory_order_release); }
+
+private:
+	std::atomic_flag flag_;
+};
+
+/**
+ * A fixed set of spinlocks shared by every future, picked by address.
+ * Two futures may end up with the same lock, which is fine as long as
+ * nobody holds more than one at a time.
+ */
+template<std::size_t N>
+struct lock_pool {
+	static spinlock &lock_for(const void *p) noexcept {
+		static spinlock locks[N];
+		/* Heap allocations are at least 16-byte aligned, so the low bits tell us nothing */
+		return locks[(reinterpret_cast<std::uintptr_t>(p) >> 4) % N];
+	}
+};
+
+}
+
+/**
+ * Thread policy for futures that may be shared between threads.
+ * Anything touched from more than one place is a std::atomic.
+ */
+struct multi_thread {
+	template<typename U> using atomic = std::atomic<U>;
+	using mutex = std::mutex;
+	/** Each future gets its own mutex, allocated when first needed */
+	static constexpr std::size_t lock_stripes = 0;
+};
+
+/**
+ * As multi_thread, but rather than each future having a std::mutex of
+ * its own, futures share a global pool of Stripes spinlocks. These are
+ * only taken while copying or moving a future, so moving no longer
+ * needs to allocate space for a mutex.
+ */
+template<std::size_t Stripes = 64>
+struct striped_multi_thread {
+	static_assert(Stripes > 0, "need at least one lock");
+	template<typename U> using atomic = std::atomic<U>;
+	using mutex = detail::spinlock;
+	static constexpr std::size_t lock_stripes = Stripes;
+	static mutex &lock_for(const void *p) noexcept { return detail::lock_pool<Stripes>::lock_for(p); }
+};
+
+/**
+ * Thread policy for futures that are created, resolved and released on
+ * a single thread, typically an event loop. Reference counts, state
+ * and the task list become plain integers, and there's no locking.
+ */
+struct single_thread {
+	template<typename U> using atomic = detail::plain_atomic<U>;
+	using mutex = detail::null_mutex;
+	static constexpr std::size_t lock_stripes = 0;
+};
+
+#if CPS_FUTURE_SINGLE_THREADED
+using default_thread_policy = single_thread;
+#elif CPS_FUTURE_LOCK_STRIPES
+using default_thread_policy = striped_multi_thread<CPS_FUTURE_LOCK_STRIPES>;
+#else
+using default_thread_policy = multi_thread;
+#endif
+
+};
+
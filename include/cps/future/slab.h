@@ -0,0 +1,179 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace cps {
+
+namespace detail {
+
+/**
+ * Per-thread free lists for blocks of a single size.
+ *
+ * Each thread allocates from its own pool without any synchronisation.
+ * A block freed on the thread that owns its pool goes straight back on
+ * that pool's free list; a block freed anywhere else is pushed onto the
+ * owning pool's remote list, which is lock-free, and the owner takes
+ * the whole remote list back in one go when its own list runs dry.
+ *
+ * Memory is never returned to the system. When a thread exits, its pool
+ * is parked for the next new thread to pick up, so blocks still in use
+ * elsewhere have somewhere to go back to.
+ */
+template<std::size_t Size, std::size_t Align>
+class slab_pool {
+public:
+	static_assert(Align <= alignof(std::max_align_t), "over-aligned types need their own allocator");
+
+	/** Returns space for one block */
+	static void *allocate() { return local().take(); }
+
+	/** Returns a block from allocate() to its pool, from any thread */
+	static void deallocate(void *p) noexcept {
+		auto n = reinterpret_cast<node *>(static_cast<char *>(p) - offsetof(node, storage));
+		auto owner = n->owner;
+		if(owner == current())
+			owner->push_local(n);
+		else
+			owner->push_remote(n);
+	}
+
+private:
+	/** Number of blocks we allocate in one go */
+	static constexpr std::size_t per_slab = 64;
+
+	struct node {
+		/** The pool this block goes back to */
+		slab_pool *owner;
+		union {
+			/** Next free block, while we're on a free list */
+			node *next;
+			typename std::aligned_storage<Size, Align>::type storage;
+		};
+	};
+
+	/** Owns this thread's pool, and parks it when the thread exits */
+	struct holder {
+		holder():pool(adopt()) { current() = pool; }
+		~holder() { current() = nullptr; park(pool); }
+		slab_pool *pool;
+	};
+
+	slab_pool():free_(nullptr), remote_(nullptr) { }
+
+	static slab_pool &local() {
+		static thread_local holder h;
+		return *h.pool;
+	}
+
+	/**
+	 * This thread's pool, or nullptr if it has never allocated or has
+	 * already parked its pool on the way out. A plain pointer, so that
+	 * freeing never has to construct anything, even during thread exit.
+	 */
+	static slab_pool *&current() noexcept {
+		static thread_local slab_pool *pool = nullptr;
+		return pool;
+	}
+
+	void *take() {
+		if(!free_)
+			free_ = remote_.exchange(nullptr, std::memory_order_acquire);
+		if(!free_)
+			refill();
+		auto n = free_;
+		free_ = n->next;
+		return &n->storage;
+	}
+
+	void refill() {
+		auto slab = static_cast<node *>(::operator new(sizeof(node) * per_slab));
+		for(std::size_t i = 0; i < per_slab; ++i) {
+			slab[i].owner = this;
+			slab[i].next = free_;
+			free_ = &slab[i];
+		}
+	}
+
+	void push_local(node *n) noexcept {
+		n->next = free_;
+		free_ = n;
+	}
+
+	/* Only the owner ever takes from the remote list, and it takes everything, so there's no ABA to worry about */
+	void push_remote(node *n) noexcept {
+		auto head = remote_.load(std::memory_order_relaxed);
+		do {
+			n->next = head;
+		} while(!remote_.compare_exchange_weak(head, n, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	/** Pools from threads that have gone away */
+	static std::mutex &parked_mutex() { static std::mutex m; return m; }
+	static std::vector<slab_pool *> &parked() { static std::vector<slab_pool *> pools; return pools; }
+
+	static slab_pool *adopt() {
+		std::lock_guard<std::mutex> guard { parked_mutex() };
+		auto &pools = parked();
+		if(pools.empty())
+			return new slab_pool();
+		auto pool = pools.back();
+		pools.pop_back();
+		return pool;
+	}
+
+	static void park(slab_pool *pool) {
+		std::lock_guard<std::mutex> guard { parked_mutex() };
+		parked().push_back(pool);
+	}
+
+	/** Blocks available to the owning thread */
+	node *free_;
+	/** Blocks freed by other threads */
+	std::atomic<node *> remote_;
+};
+
+}
+
+/**
+ * Allocator which hands out single objects from per-thread slabs, see
+ * detail::slab_pool. Use it for things that are created and destroyed
+ * in large numbers, such as futures:
+ *
+ *     auto f = make_future<int>(std::allocator_arg, slab_allocator<int>());
+ *
+ * Requests for more than one object go to the global allocator.
+ */
+template<typename T>
+class slab_allocator {
+public:
+	using value_type = T;
+
+	slab_allocator() noexcept { }
+	template<typename U>
+	slab_allocator(const slab_allocator<U> &) noexcept { }
+
+	T *allocate(std::size_t n) {
+		if(n != 1)
+			return static_cast<T *>(::operator new(n * sizeof(T)));
+		return static_cast<T *>(detail::slab_pool<sizeof(T), alignof(T)>::allocate());
+	}
+
+	void deallocate(T *p, std::size_t n) noexcept {
+		if(n != 1)
+			::operator delete(p);
+		else
+			detail::slab_pool<sizeof(T), alignof(T)>::deallocate(p);
+	}
+};
+
+template<typename T, typename U>
+inline bool operator==(const slab_allocator<T> &, const slab_allocator<U> &) noexcept { return true; }
+template<typename T, typename U>
+inline bool operator!=(const slab_allocator<T> &, const slab_allocator<U> &) noexcept { return false; }
+
+};
+
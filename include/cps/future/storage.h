@@ -0,0 +1,42 @@
+#pragma once
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace cps {
+
+namespace detail {
+
+/**
+ * Correctly-aligned space for a single T, which is only constructed
+ * on request. This does not track whether there's a value in there:
+ * the owner is expected to know that already (for a future, it's
+ * whether we're marked as done).
+ */
+template<typename T>
+class uninitialized {
+public:
+	uninitialized() noexcept { }
+	uninitialized(const uninitialized &) = delete;
+	uninitialized &operator=(const uninitialized &) = delete;
+
+	/** Constructs the value in place. There must not already be one. */
+	template<typename... Args>
+	T &construct(Args &&... args) {
+		return *new (&storage_) T(std::forward<Args>(args)...);
+	}
+
+	/** Destroys the value. There must be one. */
+	void destroy() noexcept { get().~T(); }
+
+	T &get() noexcept { return *reinterpret_cast<T *>(&storage_); }
+	const T &get() const noexcept { return *reinterpret_cast<const T *>(&storage_); }
+
+private:
+	typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+};
+
+}
+
+};
+
@@ -0,0 +1,64 @@
+#pragma once
+#include <chrono>
+
+namespace cps {
+
+namespace detail {
+
+/**
+ * Creation and resolution timestamps for a future, used by elapsed()
+ * and describe(). The parameter comes from CPS_FUTURE_TIMING: every
+ * future is timed by default, 0 turns timing off, and N > 1 times
+ * one future in every N created on each thread.
+ */
+template<unsigned N>
+class timing {
+public:
+	using clock = std::chrono::high_resolution_clock;
+
+	timing():created_(sample() ? clock::now() : clock::time_point()) { }
+
+	/** True if this future is being timed */
+	bool enabled() const { return created_ != clock::time_point(); }
+
+	/** Records the point at which the future was resolved */
+	void resolved() {
+		if(enabled())
+			resolved_ = clock::now();
+	}
+
+	/** Time between creation and resolution, or now if we're still pending */
+	std::chrono::nanoseconds elapsed(bool ready) const {
+		if(!enabled())
+			return std::chrono::nanoseconds(0);
+		return (ready ? resolved_ : clock::now()) - created_;
+	}
+
+private:
+	/** Only pay for thread_local when we're sampling */
+	static bool sample() {
+		if(N == 1)
+			return true;
+		static thread_local unsigned count = 0;
+		return count++ % N == 0;
+	}
+
+	/** When we were created, or the clock's epoch if we're not being timed */
+	clock::time_point created_;
+	/** When we were marked ready */
+	clock::time_point resolved_;
+};
+
+/** Timing turned off: no clock reads and no storage */
+template<>
+class timing<0> {
+public:
+	bool enabled() const { return false; }
+	void resolved() { }
+	std::chrono::nanoseconds elapsed(bool) const { return std::chrono::nanoseconds(0); }
+};
+
+}
+
+};
+
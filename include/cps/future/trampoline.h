@@ -0,0 +1,97 @@
+#pragma once
+#include <deque>
+#include <exception>
+
+namespace cps {
+
+namespace detail {
+
+/**
+ * Keeps callback chains from eating the stack.
+ *
+ * Resolving a future runs its callbacks, which often resolve another
+ * future, which runs more callbacks, and so on: a long ->then chain
+ * would otherwise recurse once per link. Each thread tracks how deeply
+ * nested it is, and past CPS_FUTURE_TRAMPOLINE_DEPTH further callback
+ * lists are queued instead. The outermost resolution then works
+ * through the queue in a loop.
+ *
+ * A queued future is kept alive by the reference its caller added,
+ * so only futures owned through handles are queued - one on the stack
+ * or in a unique_ptr runs its callbacks inline at any depth.
+ */
+class trampoline {
+public:
+	/** Runs the given callback list for the given future, and drops the reference we were given */
+	using runner = void (*)(void *owner, void *tasks);
+
+	/** True if we're nested deeply enough that callbacks should be queued rather than run */
+	static bool should_defer() noexcept {
+		const auto depth = local().depth;
+		return depth > 0 && depth >= CPS_FUTURE_TRAMPOLINE_DEPTH;
+	}
+
+	/** Queues callbacks for the outermost resolution to run */
+	static void defer(runner run, void *owner, void *tasks) {
+		local().queue.push_back(deferred { run, owner, tasks });
+	}
+
+	/** Call before running callbacks inline */
+	static void enter() noexcept { ++local().depth; }
+
+	/**
+	 * Call once those callbacks have finished. The outermost caller
+	 * drains the queue here; if any queued callbacks throw, we carry on
+	 * with the rest and rethrow the first exception at the end.
+	 */
+	static void leave() {
+		auto &s = local();
+		if(s.depth > 1) {
+			--s.depth;
+			return;
+		}
+		std::exception_ptr ex;
+		while(!s.queue.empty()) {
+			auto next = s.queue.front();
+			s.queue.pop_front();
+			try {
+				next.run(next.owner, next.tasks);
+			} catch(...) {
+				if(!ex) ex = std::current_exception();
+			}
+		}
+		--s.depth;
+		if(ex)
+			std::rethrow_exception(ex);
+	}
+
+	/** As leave, for when we're already unwinding: queued callbacks still run, but their exceptions are dropped */
+	static void leave_unwinding() noexcept {
+		try {
+			leave();
+		} catch(...) {
+		}
+	}
+
+private:
+	struct deferred {
+		runner run;
+		void *owner;
+		void *tasks;
+	};
+
+	struct state {
+		unsigned depth = 0;
+		std::deque<deferred> queue;
+	};
+
+	static state &local() {
+		static thread_local state s;
+		return s;
+	}
+};
+
+}
+
+};
+
@@ -0,0 +1,147 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace cps {
+
+template<typename Signature> class unique_function;
+
+/**
+ * A move-only std::function.
+ *
+ * Since we never copy the target, it can be move-only itself - a lambda
+ * holding a std::unique_ptr, for example. Callables up to three pointers
+ * in size are stored inline, which covers most lambdas capturing a
+ * future_ptr or two, so wrapping one doesn't allocate.
+ */
+template<typename R, typename... Args>
+class unique_function<R(Args...)> {
+public:
+	unique_function() noexcept:ops_(nullptr) { }
+	unique_function(std::nullptr_t) noexcept:ops_(nullptr) { }
+
+	template<
+		typename F,
+		typename = typename std::enable_if<
+			!std::is_same<typename std::decay<F>::type, unique_function>::value
+		>::type
+	>
+	unique_function(
+		F &&code
+	):ops_(nullptr)
+	{
+		using target = typename std::decay<F>::type;
+		using holder = typename std::conditional<fits_inline<target>::value, inline_holder<target>, heap_holder<target>>::type;
+		holder::construct(&storage_, std::forward<F>(code));
+		ops_ = &holder::table;
+	}
+
+	unique_function(
+		unique_function &&src
+	) noexcept
+	 :ops_(src.ops_)
+	{
+		if(ops_) {
+			ops_->move(&storage_, &src.storage_);
+			src.ops_ = nullptr;
+		}
+	}
+
+	unique_function &operator=(unique_function &&src) noexcept {
+		if(this != &src) {
+			reset();
+			if(src.ops_) {
+				src.ops_->move(&storage_, &src.storage_);
+				ops_ = src.ops_;
+				src.ops_ = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	unique_function(const unique_function &) = delete;
+	unique_function &operator=(const unique_function &) = delete;
+
+	~unique_function() { reset(); }
+
+	R operator()(Args... args) {
+		if(!ops_)
+			throw std::bad_function_call();
+		return ops_->invoke(&storage_, std::forward<Args>(args)...);
+	}
+
+	explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+private:
+	using storage = typename std::aligned_storage<3 * sizeof(void *), alignof(void *)>::type;
+
+	/** What we need to know about the target, one of these per callable type */
+	struct ops {
+		R (*invoke)(void *, Args &&...);
+		/** Move-constructs into the first from the second, and destroys the second */
+		void (*move)(void *, void *) noexcept;
+		void (*destroy)(void *) noexcept;
+	};
+
+	template<typename F>
+	struct fits_inline : std::integral_constant<bool,
+		sizeof(F) <= sizeof(storage)
+		&& alignof(F) <= alignof(storage)
+		&& std::is_nothrow_move_constructible<F>::value
+	> { };
+
+	/** The target lives in our own storage */
+	template<typename F>
+	struct inline_holder {
+		template<typename G>
+		static void construct(void *p, G &&code) { ::new(p) F(std::forward<G>(code)); }
+		static F &get(void *p) noexcept { return *static_cast<F *>(p); }
+
+		static R invoke(void *p, Args &&... args) { return get(p)(std::forward<Args>(args)...); }
+		static void move(void *dest, void *src) noexcept {
+			::new(dest) F(std::move(get(src)));
+			get(src).~F();
+		}
+		static void destroy(void *p) noexcept { get(p).~F(); }
+
+		static constexpr ops table { &invoke, &move, &destroy };
+	};
+
+	/** The target is too large or awkward, so our storage holds a pointer to it */
+	template<typename F>
+	struct heap_holder {
+		template<typename G>
+		static void construct(void *p, G &&code) { ::new(p) F *(new F(std::forward<G>(code))); }
+		static F *&get(void *p) noexcept { return *static_cast<F **>(p); }
+
+		static R invoke(void *p, Args &&... args) { return (*get(p))(std::forward<Args>(args)...); }
+		static void move(void *dest, void *src) noexcept { ::new(dest) F *(get(src)); }
+		static void destroy(void *p) noexcept { delete get(p); }
+
+		static constexpr ops table { &invoke, &move, &destroy };
+	};
+
+	void reset() noexcept {
+		if(ops_) {
+			ops_->destroy(&storage_);
+			ops_ = nullptr;
+		}
+	}
+
+	const ops *ops_;
+	storage storage_;
+};
+
+template<typename R, typename... Args>
+template<typename F>
+constexpr typename unique_function<R(Args...)>::ops unique_function<R(Args...)>::inline_holder<F>::table;
+
+template<typename R, typename... Args>
+template<typename F>
+constexpr typename unique_function<R(Args...)>::ops unique_function<R(Args...)>::heap_holder<F>::table;
+
+};
+
@@ -1,4 +1,6 @@
 #pragma once
+#include <tuple>
+#include <utility>
 #include <cps/future.h>
 
 namespace cps {
@@ -39,133 +41,597 @@ foreach(std::vector<T> items)
 	};
 }
 
+namespace detail {
+
+/**
+ * Tells us whether H is a handle to a future<T>, which the combinators
+ * below accept: either a future_ptr, as make_future gives us, or a
+ * std::shared_ptr.
+ */
+template<typename H>
+struct is_future_handle : std::false_type { };
+template<typename U>
+struct is_future_handle<future_ptr<U>> : std::true_type { };
+template<typename U>
+struct is_future_handle<std::shared_ptr<future<U>>> : std::true_type { };
+
+/** As is_future_handle, for every type in a parameter pack */
+template<typename... H>
+struct are_future_handles : std::true_type { };
+template<typename H, typename... Rest>
+struct are_future_handles<H, Rest...> : std::integral_constant<
+	bool,
+	is_future_handle<H>::value && are_future_handles<Rest...>::value
+> { };
+
+/** The value type of the future a handle refers to */
+template<typename H>
+using handle_value_t = typename H::element_type::value_type;
+
+/**
+ * Resolves f from an input that's already ready, the same way the
+ * combinators below would once it became ready.
+ */
+template<typename T>
+inline void resolve_from_ready(future<int> &f, const future<T> &in)
+{
+	if(in.is_done())
+		f.done(0);
+	else
+		f.fail("error");
+}
+
+/**
+ * The future needs_all returns. It carries the count of inputs still
+ * pending, so the whole aggregator is one allocation, and each input's
+ * callback only needs a pointer to it.
+ */
+template<typename Policy>
+class all_future : public future<int, Policy> {
+public:
+	using future<int, Policy>::future;
+
+	/** One of our inputs succeeded */
+	void input_done() { release(1); }
+
+	/** Drops n of the counts we're waiting for: whoever takes us to zero resolves us */
+	void release(std::ptrdiff_t n) {
+		if(pending.fetch_sub(n, std::memory_order_acq_rel) == n)
+			this->try_done(0);
+	}
+
+	/** One of our inputs failed: the first to do so fails us, and nobody else can finish us after that */
+	void input_failed() {
+		if(pending.exchange(0, std::memory_order_acq_rel) > 0)
+			this->try_fail("error");
+	}
+
+	/**
+	 * If the caller cancels us, that claims the count just as a failure
+	 * would, so inputs finishing afterwards leave us alone. The cancel
+	 * can still land between an input claiming the count and resolving
+	 * us, or our handler may be queued behind other callbacks (see
+	 * detail::trampoline), which is why release and input_failed only
+	 * try to resolve us.
+	 */
+	void stop_on_cancel() {
+		this->on_cancel([](future<int, Policy> &me) {
+			static_cast<all_future &>(me).pending.store(0, std::memory_order_release);
+		});
+	}
+
+	/** Counts still outstanding, or 0 or less once we've failed or been cancelled */
+	typename Policy::template atomic<std::ptrdiff_t> pending { 0 };
+};
+
+/**
+ * The future a vector needs_any returns: whichever input is ready
+ * first claims it, so two inputs finishing at once can't both try to
+ * resolve it.
+ */
+template<typename Policy>
+class any_future : public future<int, Policy> {
+public:
+	using future<int, Policy>::future;
+
+	void input_ready(bool succeeded) {
+		if(decided.exchange(true, std::memory_order_acq_rel))
+			return;
+		/* We can still be cancelled before we get there, see all_future::stop_on_cancel */
+		if(succeeded)
+			this->try_done(0);
+		else
+			this->try_fail("error");
+	}
+
+	/** Being cancelled decides us too, see all_future::stop_on_cancel */
+	void stop_on_cancel() {
+		this->on_cancel([](future<int, Policy> &me) {
+			static_cast<any_future &>(me).decided.store(true, std::memory_order_release);
+		});
+	}
+
+	/** Set by whichever input is ready first, or by cancellation */
+	typename Policy::template atomic<bool> decided { false };
+};
+
+/** The callback needs_all registers on each pending input */
+template<typename Policy>
+struct all_input {
+	future_ptr<int, Policy> target;
+
+	template<typename U>
+	void operator()(future<U, Policy> &in) const {
+		auto &all = static_cast<all_future<Policy> &>(*target);
+		if(in.is_done())
+			all.input_done();
+		else
+			all.input_failed();
+	}
+};
+
+/** The callback needs_any registers on each input */
+template<typename Policy>
+struct any_input {
+	future_ptr<int, Policy> target;
+
+	template<typename U>
+	void operator()(future<U, Policy> &in) const {
+		static_cast<any_future<Policy> &>(*target).input_ready(in.is_done());
+	}
+};
+
+/**
+ * The callback the single-input needs_all and the variadic needs_any
+ * register: whichever input gets there first passes on success or
+ * failure, and later ones - or a cancel from the caller - win nothing.
+ */
+template<typename Policy>
+struct first_ready_input {
+	future_ptr<int, Policy> target;
+
+	template<typename U>
+	void operator()(future<U, Policy> &in) const {
+		if(in.is_done())
+			target->try_done(0);
+		else
+			target->try_fail("error");
+	}
+};
+
+/** Counts an input towards needs_all: one we're waiting for, or one which has already failed */
+template<typename H>
+inline int count_input(const H &in, bool waiting, std::ptrdiff_t &pending, bool &failed) {
+	if(waiting)
+		++pending;
+	else if(!in->is_done())
+		failed = true;
+	return 0;
+}
+
+/** Registers the needs_all callback on an input, if it's still waiting for one */
+template<typename H>
+inline int watch_input(const H &in, const future_ptr<int> &target, bool pending) {
+	if(pending)
+		in->on_ready(all_input<default_thread_policy> { target });
+	return 0;
+}
+
+}
+
 /* Degenerate case - no futures => instant success */
 static inline
-std::shared_ptr<future<int>>
+future_ptr<int>
 needs_all()
 {
-	auto f = future<int>::create_shared();
+	auto f = future<int>::create_ptr();
 	f->done(0);
 	return f;
 }
 
 /* Base case - single future */
-template<typename T>
+template<
+	typename H,
+	typename std::enable_if<detail::is_future_handle<H>::value, bool>::type * = nullptr
+>
 static inline
-std::shared_ptr<future<int>>
-needs_all(std::shared_ptr<future<T>> first)
+future_ptr<int>
+needs_all(H first)
 {
-	auto f = future<int>::create_shared();
-	std::function<void(future<T> &)> code = [f, first](future<T> &in) {
-		if(f->is_ready()) return;
-		if(!in.is_done()) {
-			f->fail("error");
-			return;
-		}
-		f->done(0);
-	};
-	first->on_ready(code);
+	auto f = future<int>::create_ptr();
+	/* Nothing to wait for if it's already resolved */
+	if(first->is_ready()) {
+		detail::resolve_from_ready(*f, *first);
+		return f;
+	}
+	/* The caller may cancel us in the meantime */
+	first->on_ready(detail::first_ready_input<default_thread_policy> { f });
 	return f;
 }
 
-/* Allow runtime-varying list too */
-template<typename T>
+/**
+ * Allow runtime-varying list too. Every pending input gets a callback
+ * holding a single pointer to the result, which in turn holds one
+ * counter, so fanning in N futures costs O(N) however large N gets.
+ */
+template<
+	typename H,
+	typename std::enable_if<detail::is_future_handle<H>::value, bool>::type * = nullptr
+>
 static inline
-std::shared_ptr<future<int>>
-needs_all(std::vector<std::shared_ptr<future<T>>> first)
+future_ptr<int>
+needs_all(const std::vector<H> &first)
 {
-	auto f = future<int>::create_shared();
-	auto pending = std::make_shared<std::atomic<int>>(first.size());
-	std::function<void(future<T> &)> code = [f, first, pending](future<T> &in) {
-		if(f->is_ready()) return;
-		if(!in.is_done()) {
-			f->fail("error");
-			return;
+	auto f = detail::create_as<detail::all_future<default_thread_policy>>();
+	auto &all = static_cast<detail::all_future<default_thread_policy> &>(*f);
+	/* One count for each input and one for us, so nothing can finish us before we've seen them all */
+	all.pending.store(static_cast<std::ptrdiff_t>(first.size()) + 1, std::memory_order_relaxed);
+	std::ptrdiff_t ready = 0;
+	for(auto &it : first) {
+		if(!it->is_ready()) {
+			it->on_ready(detail::all_input<default_thread_policy> { f });
+		} else if(it->is_done()) {
+			++ready;
+		} else {
+			/* Already failed, so we are too */
+			all.input_failed();
+			return f;
 		}
-		if(!--(*pending)) f->done(0);
-	};
-	for(auto &it : first)
-		it->on_ready(code);
+	}
+	all.stop_on_cancel();
+	all.release(ready + 1);
 	return f;
 }
 
-template<typename T, typename ... Types>
+/**
+ * Resolves once every input has succeeded, or fails as soon as any of
+ * them fails. However many inputs there are, this allocates a single
+ * future holding one shared counter, and inputs that are already
+ * ready don't get a callback at all.
+ */
+template<
+	typename H,
+	typename ... Types,
+	typename std::enable_if<detail::are_future_handles<H, Types...>::value, bool>::type * = nullptr
+>
 static inline
-std::shared_ptr<future<int>>
-needs_all(std::shared_ptr<future<T>> first, Types ... rest)
+future_ptr<int>
+needs_all(H first, Types ... rest)
 {
-	auto remainder = needs_all(rest...);
-	auto f = future<int>::create_shared();
-	auto pending = std::make_shared<std::atomic<int>>(2);
-	std::function<void(future<T> &)> code = [f, first, remainder, pending](future<T> &in) {
-		if(f->is_ready()) return;
-		if(!in.is_done()) {
-			f->fail("error");
+	auto f = detail::create_as<detail::all_future<default_thread_policy>>();
+	/* Look at each input once, and count everything we need to wait for
+	 * before registering anything, so that none of them can finish us early.
+	 * An input that's already ready can't change, so we can check that for
+	 * failure at our leisure.
+	 */
+	const bool waiting[] = { !first->is_ready(), !rest->is_ready()... };
+	std::ptrdiff_t outstanding = 0;
+	bool failed = false;
+	std::size_t i = 0;
+	int counted[] = { detail::count_input(first, waiting[i++], outstanding, failed), detail::count_input(rest, waiting[i++], outstanding, failed)... };
+	(void) counted;
+	if(failed) {
+		f->fail("error");
+		return f;
+	}
+	if(!outstanding) {
+		f->done(0);
+		return f;
+	}
+	auto &all = static_cast<detail::all_future<default_thread_policy> &>(*f);
+	all.pending.store(outstanding, std::memory_order_release);
+	all.stop_on_cancel();
+	i = 0;
+	int watched[] = { detail::watch_input(first, f, waiting[i++]), detail::watch_input(rest, f, waiting[i++])... };
+	(void) watched;
+	return f;
+}
+
+namespace detail {
+
+/** A ready input's value: a copy, unless it can only be moved */
+template<typename U, typename P>
+inline U pass_from(future<U, P> &in, std::true_type) { return in.value(); }
+template<typename U, typename P>
+inline U pass_from(future<U, P> &in, std::false_type) { return in.take(); }
+
+/**
+ * The future the gather family returns. Storage is where input values
+ * go: the result itself for gather, and the caller's storage for
+ * needs_all_into, in which case the result is just future<int>.
+ */
+template<typename R, typename Storage, typename Policy>
+class gather_future : public future<R, Policy> {
+public:
+	using future<R, Policy>::future;
+
+	/** One of our inputs succeeded, so its value goes where the slot says */
+	template<typename Slot, typename U>
+	void input_done(const Slot &slot, future<U, Policy> &in) {
+		/* No point in filling in values once we've failed or been cancelled */
+		if(pending.load(std::memory_order_acquire) <= 0 || this->is_ready())
 			return;
-		}
-		if(!--(*pending)) f->done(0);
-	};
-	first->on_ready(code);
-	remainder->on_ready(code);
+		slot(storage, pass_from(in, std::is_copy_constructible<U>()));
+		release(1);
+	}
+
+	/** Drops n of the counts we're waiting for: whoever takes us to zero resolves us */
+	void release(std::ptrdiff_t n) {
+		if(pending.fetch_sub(n, std::memory_order_acq_rel) == n)
+			finish(std::is_same<R, Storage>());
+	}
+
+	/** One of our inputs failed or was cancelled: the first to do so passes that on */
+	template<typename U>
+	void input_failed(future<U, Policy> &in) {
+		if(pending.exchange(0, std::memory_order_acq_rel) <= 0)
+			return;
+		if(in.is_failed())
+			this->try_fail_from(in);
+		else
+			this->try_cancel();
+	}
+
+	/** Cancelling us claims the count, see all_future::stop_on_cancel */
+	void stop_on_cancel() {
+		this->on_cancel([](future<R, Policy> &me) {
+			static_cast<gather_future &>(me).pending.store(0, std::memory_order_release);
+		});
+	}
+
+	Storage storage;
+	/** Counts still outstanding, or 0 or less once we've failed or been cancelled */
+	typename Policy::template atomic<std::ptrdiff_t> pending { 0 };
+
+private:
+	/* The caller may cancel us right up until we resolve, see all_future::stop_on_cancel */
+	void finish(std::true_type) { this->try_done(std::move(storage)); }
+	void finish(std::false_type) { this->try_done(0); }
+};
+
+/** Where a vector input's value goes */
+struct index_slot {
+	std::size_t index;
+
+	template<typename S, typename V>
+	void operator()(S &storage, V &&v) const { storage[index] = std::forward<V>(v); }
+};
+
+/** Where a tuple input's value goes */
+template<std::size_t I>
+struct tuple_slot {
+	template<typename S, typename V>
+	void operator()(S &storage, V &&v) const { std::get<I>(storage) = std::forward<V>(v); }
+};
+
+/** The callback the gather family registers on each pending input */
+template<typename Target, typename Slot>
+struct gather_input {
+	future_ptr<typename Target::value_type, typename Target::policy_type> target;
+	Slot slot;
+
+	template<typename U, typename P>
+	void operator()(future<U, P> &in) const {
+		auto &t = static_cast<Target &>(*target);
+		if(in.is_done())
+			t.input_done(slot, in);
+		else
+			t.input_failed(in);
+	}
+};
+
+/**
+ * Adds an input to a gather: a callback if it's pending, its value
+ * straight away if it's done, and if it has failed, so have we.
+ */
+template<typename Target, typename Slot, typename U>
+inline int gather_one(
+	const future_ptr<typename Target::value_type, typename Target::policy_type> &f,
+	Target &t,
+	const Slot &slot,
+	future<U> &in,
+	std::ptrdiff_t &ready,
+	bool &failed
+) {
+	if(failed)
+		return 0;
+	if(!in.is_ready()) {
+		in.on_ready(gather_input<Target, Slot> { f, slot });
+	} else if(in.is_done()) {
+		slot(t.storage, pass_from(in, std::is_copy_constructible<U>()));
+		++ready;
+	} else {
+		t.input_failed(in);
+		failed = true;
+	}
+	return 0;
+}
+
+/* As with needs_all, we hold one count for each input plus one for ourselves,
+ * so nothing can finish us before we've seen them all.
+ */
+template<typename Target, typename H>
+inline void gather_vector(
+	const future_ptr<typename Target::value_type, typename Target::policy_type> &f,
+	Target &t,
+	const std::vector<H> &in
+) {
+	t.pending.store(static_cast<std::ptrdiff_t>(in.size()) + 1, std::memory_order_relaxed);
+	t.stop_on_cancel();
+	std::ptrdiff_t ready = 0;
+	bool failed = false;
+	for(std::size_t i = 0; i < in.size() && !failed; ++i)
+		gather_one(f, t, index_slot { i }, *in[i], ready, failed);
+	if(!failed)
+		t.release(ready + 1);
+}
+
+template<typename Target, std::size_t... I, typename... H>
+inline void gather_tuple(
+	const future_ptr<typename Target::value_type, typename Target::policy_type> &f,
+	Target &t,
+	std::index_sequence<I...>,
+	const H &... in
+) {
+	t.pending.store(static_cast<std::ptrdiff_t>(sizeof...(H)) + 1, std::memory_order_relaxed);
+	t.stop_on_cancel();
+	std::ptrdiff_t ready = 0;
+	bool failed = false;
+	int expand[] = { 0, gather_one(f, t, tuple_slot<I> { }, *in, ready, failed)... };
+	(void) expand;
+	if(!failed)
+		t.release(ready + 1);
+}
+
+}
+
+/**
+ * Like needs_all, but collects the values too: resolves with every
+ * input's value, in order, once they've all succeeded. Each value is
+ * put in place as its input completes, so nobody has to go back over
+ * the inputs afterwards, and the finished vector is moved into the
+ * result rather than copied.
+ *
+ * Values are copied out of their inputs, since other code may still
+ * want them; move-only values are taken instead. The first input to
+ * fail or be cancelled does the same to the result.
+ */
+template<
+	typename H,
+	typename T = detail::handle_value_t<H>,
+	typename std::enable_if<detail::is_future_handle<H>::value, bool>::type * = nullptr
+>
+static inline
+future_ptr<std::vector<T>>
+gather(const std::vector<H> &in)
+{
+	static_assert(!std::is_same<T, bool>::value, "std::vector<bool> can't be filled from several threads at once, try needs_all_into with a std::vector<char>");
+	using target = detail::gather_future<std::vector<T>, std::vector<T>, default_thread_policy>;
+	auto f = detail::create_as<target>();
+	auto &t = static_cast<target &>(*f);
+	t.storage.resize(in.size());
+	detail::gather_vector(f, t, in);
+	return f;
+}
+
+/** As above, for a fixed set of futures of any types, giving a tuple of their values */
+template<
+	typename... H,
+	typename std::enable_if<detail::are_future_handles<H...>::value, bool>::type * = nullptr
+>
+static inline
+future_ptr<std::tuple<detail::handle_value_t<H>...>>
+gather(H... in)
+{
+	using tuple_type = std::tuple<detail::handle_value_t<H>...>;
+	using target = detail::gather_future<tuple_type, tuple_type, default_thread_policy>;
+	auto f = detail::create_as<target>();
+	detail::gather_tuple(f, static_cast<target &>(*f), std::index_sequence_for<H...>(), in...);
+	return f;
+}
+
+/**
+ * Like gather, but writes the values into storage the caller already
+ * has, so the only allocation is the future<int> we return:
+ *
+ *     std::vector<int> counts(shards.size());
+ *     needs_all_into(shards, counts.data());
+ *
+ * out can be anything indexable which refers to that storage - a
+ * pointer, a random-access iterator, or a std::span - and needs room
+ * for every input. Since an input may complete after another one has
+ * failed the result, the storage must stay around until every input
+ * is ready, not just the result.
+ */
+template<
+	typename H,
+	typename Out,
+	typename std::enable_if<detail::is_future_handle<H>::value, bool>::type * = nullptr
+>
+static inline
+future_ptr<int>
+needs_all_into(const std::vector<H> &in, Out out)
+{
+	using target = detail::gather_future<int, Out, default_thread_policy>;
+	auto f = detail::create_as<target>();
+	auto &t = static_cast<target &>(*f);
+	t.storage = out;
+	detail::gather_vector(f, t, in);
 	return f;
 }
 
 /* Degenerate case - no futures => instant fail */
 static inline
-std::shared_ptr<future<int>>
+future_ptr<int>
 needs_any()
 {
-	auto f = future<int>::create_shared();
+	auto f = future<int>::create_ptr();
 	f->fail("no elements");
 	return f;
 }
 
 /* Base case - single future */
-template<typename T>
+template<
+	typename H,
+	typename std::enable_if<detail::is_future_handle<H>::value, bool>::type * = nullptr
+>
 static inline
-std::shared_ptr<future<int>>
-needs_any(std::shared_ptr<future<T>> first)
+future_ptr<int>
+needs_any(H first)
 {
 	return needs_all(first);
 }
 
-/* Allow runtime-varying list too */
-template<typename T>
+/* Allow runtime-varying list too, see needs_all for the costs */
+template<
+	typename H,
+	typename std::enable_if<detail::is_future_handle<H>::value, bool>::type * = nullptr
+>
 static inline
-std::shared_ptr<future<int>>
-needs_any(std::vector<std::shared_ptr<future<T>>> first)
+future_ptr<int>
+needs_any(const std::vector<H> &first)
 {
-	auto f = future<int>::create_shared();
-	std::function<void(future<T> &)> code = [f, first](future<T> &in) {
-		if(f->is_ready()) return;
-		if(!in.is_done()) {
-			f->fail("error");
-			return;
+	auto f = detail::create_as<detail::any_future<default_thread_policy>>();
+	/* As with the variadic form, there's nothing that could ever succeed */
+	if(first.empty()) {
+		f->fail("no elements");
+		return f;
+	}
+	/* The first one to be ready decides, so if any already are, we don't need to wait */
+	for(auto &it : first) {
+		if(it->is_ready()) {
+			detail::resolve_from_ready(*f, *it);
+			return f;
 		}
-		f->done(0);
-	};
+	}
+	static_cast<detail::any_future<default_thread_policy> &>(*f).stop_on_cancel();
 	for(auto &it : first)
-		it->on_ready(code);
+		it->on_ready(detail::any_input<default_thread_policy> { f });
 	return f;
 }
 
-template<typename T, typename ... Types>
+template<
+	typename H,
+	typename ... Types,
+	typename std::enable_if<detail::are_future_handles<H, Types...>::value, bool>::type * = nullptr
+>
 static inline
-std::shared_ptr<future<int>>
-needs_any(std::shared_ptr<future<T>> first, Types ... rest)
+future_ptr<int>
+needs_any(H first, Types ... rest)
 {
 	auto remainder = needs_all(rest...);
-	auto f = future<int>::create_shared();
-	std::function<void(future<T> &)> code = [f, first, remainder](future<T> &in) {
-		if(f->is_ready()) return;
-		if(!in.is_done()) {
-			f->fail("error");
-			return;
-		}
-		f->done(0);
-	};
-	first->on_ready(code);
-	remainder->on_ready(code);
+	auto f = future<int>::create_ptr();
+	if(first->is_ready()) {
+		detail::resolve_from_ready(*f, *first);
+		return f;
+	}
+	if(remainder->is_ready()) {
+		detail::resolve_from_ready(*f, *remainder);
+		return f;
+	}
+	/* Either side may get here first, or the caller may cancel us */
+	first->on_ready(detail::first_ready_input<default_thread_policy> { f });
+	remainder->on_ready(detail::first_ready_input<default_thread_policy> { f });
 	return f;
 }
 
@@ -5,6 +5,8 @@ set(CXX_NORM_CXX98 1)   # C++98
 set(CXX_NORM_CXX03 2)   # C++03
 set(CXX_NORM_CXX11 3)   # C++11
 set(CXX_NORM_CXX14 4)   # C++14
+set(CXX_NORM_CXX17 5)   # C++17
+set(CXX_NORM_CXX20 6)   # C++20
 
 # - Set the wanted C++ norm
 # Adds the good argument to the command line in function of the compiler
@@ -48,6 +50,22 @@ macro(set_cxx_norm NORM)
             else()
                 add_definitions("-std=c++14")
             endif()
+        elseif(${NORM} EQUAL ${CXX_NORM_CXX17})
+            if(${cxx_compiler_version} VERSION_LESS "8.0.0")
+                add_definitions("-std=c++1z")
+            else()
+                add_definitions("-std=c++17")
+            endif()
+        elseif(${NORM} EQUAL ${CXX_NORM_CXX20})
+            if(${cxx_compiler_version} VERSION_LESS "10.0.0")
+                add_definitions("-std=c++2a")
+            else()
+                add_definitions("-std=c++20")
+            endif()
+            # Coroutines are only on by default from g++ 11
+            if(${cxx_compiler_version} VERSION_LESS "11.0.0")
+                add_definitions("-fcoroutines")
+            endif()
         endif()
 
     elseif(${CMAKE_CXX_COMPILER_ID} STREQUAL "Clang")
@@ -56,6 +74,10 @@ macro(set_cxx_norm NORM)
             add_definitions("-std=c++11")
 		elseif(${NORM} EQUAL ${CXX_NORM_CXX14})
             add_definitions("-std=c++14")
+        elseif(${NORM} EQUAL ${CXX_NORM_CXX17})
+            add_definitions("-std=c++17")
+        elseif(${NORM} EQUAL ${CXX_NORM_CXX20})
+            add_definitions("-std=c++20")
         endif()
 
     endif()
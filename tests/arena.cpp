@@ -0,0 +1,193 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+/*
+ * Every trip through the global allocator, in any form, so we can check
+ * that arena-scoped code stays off it. These replace the operators for
+ * the whole test binary, but only count.
+ */
+static std::atomic<size_t> global_allocations { 0 };
+
+static void *counted_malloc(size_t size) noexcept {
+	++global_allocations;
+	return std::malloc(size ? size : 1);
+}
+
+static void *counted_new(size_t size) {
+	if(auto p = counted_malloc(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size) { return counted_new(size); }
+void *operator new[](size_t size) { return counted_new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return counted_malloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return counted_malloc(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+
+#if defined(__cpp_aligned_new)
+static void *counted_aligned_malloc(size_t size, std::align_val_t align) noexcept {
+	++global_allocations;
+	const auto a = static_cast<size_t>(align);
+	return std::aligned_alloc(a, size ? (size + a - 1) / a * a : a);
+}
+
+static void *counted_aligned_new(size_t size, std::align_val_t align) {
+	if(auto p = counted_aligned_malloc(size, align))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) { return counted_aligned_new(size, align); }
+void *operator new[](size_t size, std::align_val_t align) { return counted_aligned_new(size, align); }
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return counted_aligned_malloc(size, align); }
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return counted_aligned_malloc(size, align); }
+
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+#endif
+
+SCENARIO("futures from a request arena", "[arena]") {
+	GIVEN("an arena") {
+		cps::arena a;
+		CHECK(arena::current() == nullptr);
+		WHEN("we build a graph of futures inside a scope") {
+			future_ptr<string> result;
+			auto initial = make_future<int>();
+			{
+				arena_scope scope { a };
+				CHECK(arena::current() == &a);
+				initial = make_future<int>();
+				result = initial->then([](int v) {
+					return resolved_future(to_string(v));
+				});
+			}
+			THEN("they all come from the arena") {
+				CHECK(arena::current() == nullptr);
+				CHECK(a.live() == 2);
+			}
+			initial->done(12);
+			AND_THEN("they still work as usual") {
+				REQUIRE(result->is_done());
+				CHECK(result->value() == "12");
+			}
+			initial.reset();
+			result.reset();
+			AND_THEN("releasing them drops the count") {
+				CHECK(a.live() == 0);
+			}
+		}
+		WHEN("we nest scopes") {
+			cps::arena inner;
+			{
+				arena_scope outer_scope { a };
+				{
+					arena_scope inner_scope { inner };
+					CHECK(arena::current() == &inner);
+				}
+				CHECK(arena::current() == &a);
+			}
+			THEN("the previous arena comes back each time") {
+				CHECK(arena::current() == nullptr);
+			}
+		}
+	}
+	GIVEN("a future which outlives its arena") {
+		future_ptr<int> escaped;
+		{
+			cps::arena a;
+			arena_scope scope { a };
+			escaped = make_future<int>("escaped");
+		}
+		THEN("it is still usable") {
+			CHECK(escaped->label() == "escaped");
+			escaped->done(5);
+			CHECK(escaped->value() == 5);
+		}
+	}
+}
+
+SCENARIO("arena-scoped graphs stay off the global heap", "[arena]") {
+	GIVEN("an arena which has already started its first chunk") {
+		cps::arena a { 65536 };
+		arena_scope scope { a };
+		/* The first allocation sets up the arena's chunk list, and resolving this wakes up our trampoline */
+		make_future<int>()->on_done([](int) { })->done(0);
+		const auto ex = std::make_exception_ptr(std::runtime_error("backend unavailable"));
+		WHEN("we build and resolve a graph of ->then, needs_all and needs_any") {
+			const size_t before = global_allocations;
+			auto first = future<int>::create_shared();
+			auto second = future<int>::create_shared();
+			auto all = needs_all(first, second);
+			auto one = needs_all(first);
+			auto any = needs_any(first, second);
+			auto doubled = first->then([](int v) { return resolved_future(v * 2); });
+			auto initial = make_future<int>();
+			auto failed = initial;
+			for(int i = 0; i < 10; ++i)
+				failed = failed->then([](int v) { return resolved_future(v + 1); });
+			auto recovered = failed->then(
+				[](int v) { return resolved_future(v); },
+				[](const std::runtime_error &) { return resolved_future(-1); }
+			);
+			first->done(21);
+			second->done(1);
+			initial->fail_exception_pointer(ex);
+			const size_t after = global_allocations;
+			THEN("nothing came from the global allocator") {
+				CHECK(after == before);
+			}
+			AND_THEN("everything resolved as usual") {
+				CHECK(all->is_done());
+				CHECK(one->is_done());
+				CHECK(any->is_done());
+				CHECK(doubled->value() == 42);
+				CHECK(failed->is_failed());
+				CHECK(recovered->value() == -1);
+			}
+		}
+	}
+}
+
+#if CPS_FUTURE_HAVE_PMR
+SCENARIO("arena memory from a std::pmr resource", "[arena]") {
+	GIVEN("a monotonic buffer") {
+		std::pmr::monotonic_buffer_resource upstream;
+		cps::arena a { &upstream };
+		arena_scope scope { a };
+		auto f = make_future<int>()->done(3);
+		THEN("the future works") {
+			CHECK(f->value() == 3);
+			CHECK(a.live() == 1);
+		}
+	}
+	GIVEN("a polymorphic_allocator") {
+		std::pmr::monotonic_buffer_resource upstream;
+		auto f = make_future<int>(std::allocator_arg, std::pmr::polymorphic_allocator<int>(&upstream));
+		f->done(4);
+		THEN("the future works") {
+			CHECK(f->value() == 4);
+		}
+	}
+}
+#endif
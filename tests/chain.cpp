@@ -0,0 +1,162 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("we can fuse ->transform steps with chain()", "[composed][chain]") {
+	GIVEN("a pending future and a three-step chain") {
+		auto f = make_future<string>();
+		int calls = 0;
+		auto len = f->chain()
+			.transform([&calls](const string &s) { ++calls; return s + s; })
+			.transform([&calls](const string &s) { ++calls; return s.size(); })
+			.transform([&calls](size_t n) { ++calls; return static_cast<int>(n) * 10; })
+			.future();
+		THEN("nothing has run yet") {
+			CHECK(calls == 0);
+			CHECK(!len->is_ready());
+		}
+		WHEN("the source completes") {
+			f->done("abc");
+			THEN("every step ran once, in order") {
+				CHECK(calls == 3);
+				REQUIRE(len->is_done());
+				CHECK(len->value() == 60);
+			}
+		}
+		WHEN("the source fails") {
+			f->fail("no input");
+			THEN("the failure passes straight through") {
+				CHECK(calls == 0);
+				REQUIRE(len->is_failed());
+				CHECK(len->failure_reason() == "no input");
+			}
+		}
+		WHEN("the source is cancelled") {
+			f->cancel();
+			THEN("so is the result") {
+				CHECK(len->is_cancelled());
+			}
+		}
+	}
+	GIVEN("a chain where a middle step throws") {
+		auto f = make_future<int>();
+		bool last = false;
+		auto out = f->chain()
+			.transform([](int v) { return v + 1; })
+			.transform([](int) -> int { throw std::runtime_error("bad step"); })
+			.transform([&last](int v) { last = true; return v; })
+			.future();
+		WHEN("the source completes") {
+			f->done(1);
+			THEN("the result fails, and later steps are skipped") {
+				CHECK(!last);
+				REQUIRE(out->is_failed());
+				CHECK(out->failure_reason() == "bad step");
+			}
+		}
+	}
+	GIVEN("a chain with no steps") {
+		auto f = make_future<int>();
+		auto out = f->chain().future();
+		WHEN("the source completes") {
+			f->done(7);
+			THEN("the result has the same value") {
+				CHECK(out->value() == 7);
+			}
+		}
+	}
+}
+
+SCENARIO("chain() only allocates the final future", "[composed][chain][arena]") {
+	GIVEN("a resolved future and a ten-step chain built inside an arena") {
+		auto f = make_future<int>()->done(0);
+		cps::arena a;
+		future_ptr<int> out;
+		{
+			arena_scope scope { a };
+			auto c = f->chain().transform([](int v) { return v + 1; });
+			auto nine_more = std::move(c)
+				.transform([](int v) { return v + 1; })
+				.transform([](int v) { return v + 1; })
+				.transform([](int v) { return v + 1; })
+				.transform([](int v) { return v + 1; })
+				.transform([](int v) { return v + 1; })
+				.transform([](int v) { return v + 1; })
+				.transform([](int v) { return v + 1; })
+				.transform([](int v) { return v + 1; })
+				.transform([](int v) { return v + 1; });
+			out = std::move(nine_more).future();
+		}
+		THEN("there is a single future, with every step applied") {
+			CHECK(a.live() == 1);
+			CHECK(out->value() == 10);
+		}
+	}
+}
+
+SCENARIO("chain() can finish with ->then", "[composed][chain]") {
+	GIVEN("a chain ending in a step that returns a future") {
+		auto f = make_future<int>();
+		auto inner = make_future<string>();
+		auto out = f->chain()
+			.transform([](int v) { return v * 2; })
+			.then([inner](int v) {
+				CHECK(v == 42);
+				return inner;
+			});
+		WHEN("the source and the inner future complete") {
+			f->done(21);
+			CHECK(!out->is_ready());
+			inner->done("answer");
+			THEN("the result has the inner value") {
+				REQUIRE(out->is_done());
+				CHECK(out->value() == "answer");
+			}
+		}
+		WHEN("the source fails") {
+			f->fail("broken");
+			THEN("the result fails too") {
+				CHECK(out->is_failed());
+			}
+		}
+	}
+}
+
+SCENARIO("a throwing chain step reaches ->then's error handlers", "[composed][chain]") {
+	GIVEN("the same steps, with and without a chain") {
+		auto f = make_future<int>();
+		auto throwing = [](int) -> int { throw std::runtime_error("bad step"); };
+		auto ok = [](int v) { return resolved_future(v); };
+		auto fused = f->chain()
+			.transform(throwing)
+			.then(ok, [](const std::runtime_error &) { return resolved_future(-1); });
+		auto unfused = f->transform(throwing)
+			->then(ok, [](const std::runtime_error &) { return resolved_future(-1); });
+		WHEN("the source completes") {
+			f->done(1);
+			THEN("both recover through the error handler") {
+				REQUIRE(unfused->is_done());
+				CHECK(unfused->value() == -1);
+				REQUIRE(fused->is_done());
+				CHECK(fused->value() == -1);
+			}
+		}
+	}
+	GIVEN("an error handler which doesn't match") {
+		auto f = make_future<int>();
+		auto out = f->chain()
+			.transform([](int) -> int { throw std::runtime_error("bad step"); })
+			.then([](int v) { return resolved_future(v); }, [](const std::out_of_range &) { return resolved_future(-1); });
+		WHEN("the source completes") {
+			f->done(1);
+			THEN("the step's failure passes through") {
+				REQUIRE(out->is_failed());
+				CHECK(out->failure_reason() == "bad step");
+			}
+		}
+	}
+}
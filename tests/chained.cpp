@@ -255,3 +255,249 @@ SCENARIO("exception within ->then branches") {
 	}
 }
 
+
+SCENARIO("failures propagate along a ->then chain", "[composed][shared]") {
+	GIVEN("a three-link chain") {
+		auto initial = cps::make_future<string>();
+		int called = 0;
+		auto seq = initial->then([&called](string v) {
+			++called;
+			return cps::resolved_future<string>(v);
+		})->then([&called](string v) {
+			++called;
+			return cps::resolved_future<string>(v);
+		})->then([&called](string v) {
+			++called;
+			return cps::resolved_future<string>(v);
+		});
+		WHEN("the first future fails") {
+			initial->fail(CustomException { "backend down" });
+			THEN("none of the callbacks ran") {
+				CHECK(called == 0);
+			}
+			AND_THEN("the end of the chain has the original exception") {
+				REQUIRE(seq->is_failed());
+				CHECK(seq->exception_ptr() == initial->exception_ptr());
+				REQUIRE_THROWS_AS(seq->value(), CustomException);
+				CHECK(seq->failure_reason() == "backend down");
+			}
+		}
+		WHEN("an inner future fails") {
+			auto inner = cps::make_future<string>();
+			auto seq2 = initial->then([inner](string) {
+				return inner;
+			});
+			initial->done("ok");
+			inner->fail(CustomException { "inner" });
+			THEN("the failure propagates with the same exception") {
+				REQUIRE(seq2->is_failed());
+				CHECK(seq2->exception_ptr() == inner->exception_ptr());
+				CHECK(seq2->failure_reason() == "inner");
+			}
+		}
+	}
+}
+
+namespace {
+
+/** Counts copies, so we can tell whether values were moved along a chain */
+struct copy_counter {
+	copy_counter(int &copies):copies(&copies) { }
+	copy_counter(const copy_counter &src):copies(src.copies) { ++*copies; }
+	copy_counter(copy_counter &&src) = default;
+	copy_counter &operator=(const copy_counter &) = default;
+	copy_counter &operator=(copy_counter &&) = default;
+	int *copies;
+};
+
+}
+
+SCENARIO("->then forwards results with one callback", "[composition][shared]") {
+	GIVEN("a chain where each link returns a fresh future") {
+		int copies = 0;
+		auto initial = cps::make_future<int>();
+		auto seq = initial->then([&copies](int) {
+			return cps::resolved_future(copy_counter { copies });
+		});
+		initial->done(1);
+		THEN("the value is moved through rather than copied") {
+			REQUIRE(seq->is_done());
+			CHECK(copies == 0);
+		}
+	}
+	GIVEN("an inner future that someone else is holding") {
+		int copies = 0;
+		auto inner = cps::make_future<copy_counter>();
+		auto initial = cps::make_future<int>();
+		auto seq = initial->then([inner](int) { return inner; });
+		initial->done(1);
+		inner->done(copy_counter { copies });
+		THEN("they can still see the value") {
+			REQUIRE(seq->is_done());
+			CHECK(inner->is_done());
+			CHECK(copies == 1);
+			CHECK(inner->get_ref().copies == &copies);
+		}
+	}
+	GIVEN("an inner future which is resolved later by its only other holder") {
+		int copies = 0;
+		cps::future_ptr<copy_counter> pending;
+		auto initial = cps::make_future<int>();
+		auto seq = initial->then([&pending](int) {
+			pending = cps::make_future<copy_counter>();
+			return pending;
+		});
+		initial->done(1);
+		pending->done(copy_counter { copies });
+		THEN("the value is copied, so the resolver can still see it") {
+			REQUIRE(seq->is_done());
+			CHECK(copies == 1);
+			CHECK(pending->get_ref().copies == &copies);
+		}
+	}
+	GIVEN("a chain whose inner future is cancelled") {
+		auto inner = cps::make_future<int>();
+		auto initial = cps::make_future<int>();
+		auto seq = initial->then([inner](int) { return inner; });
+		initial->done(1);
+		WHEN("we cancel the outer future") {
+			seq->cancel();
+			THEN("the inner one is cancelled too, without trying to cancel us twice") {
+				CHECK(inner->is_cancelled());
+				CHECK(seq->is_cancelled());
+			}
+		}
+	}
+}
+
+SCENARIO("->then on futures that are already resolved", "[composition][shared]") {
+	GIVEN("a future that is already done") {
+		auto initial = cps::resolved_future(5);
+		auto inner = cps::resolved_future(string("cached"));
+		auto seq = initial->then([inner](int) { return inner; });
+		THEN("we get the callback's future back directly") {
+			CHECK(seq == inner);
+			CHECK(seq->value() == "cached");
+		}
+	}
+	GIVEN("a future that is already done, with a callback that throws") {
+		auto initial = cps::resolved_future(5);
+		auto seq = initial->then([](int) -> cps::future_ptr<string> {
+			throw CustomException { "broken" };
+		});
+		THEN("the result is failed") {
+			REQUIRE(seq->is_failed());
+			REQUIRE_THROWS_AS(seq->value(), CustomException);
+		}
+	}
+	GIVEN("a future that has already failed") {
+		auto initial = cps::make_future<int>();
+		initial->fail(CustomException { "early" });
+		WHEN("there's a matching error handler") {
+			auto handled = cps::resolved_future(string("handled"));
+			auto seq = initial->then([](int) {
+				return cps::resolved_future(string("ok"));
+			}, [handled](const CustomException &) {
+				return handled;
+			});
+			THEN("we get the handler's future back") {
+				CHECK(seq == handled);
+			}
+		}
+		WHEN("there's no error handler") {
+			auto seq = initial->then([](int) {
+				return cps::resolved_future(string("ok"));
+			});
+			THEN("the failure carries over") {
+				REQUIRE(seq->is_failed());
+				CHECK(seq->exception_ptr() == initial->exception_ptr());
+			}
+		}
+	}
+	GIVEN("a future that was cancelled") {
+		auto initial = cps::make_future<int>();
+		initial->cancel();
+		auto seq = initial->then([](int) {
+			return cps::resolved_future(string("ok"));
+		});
+		THEN("so is the result") {
+			CHECK(seq->is_cancelled());
+		}
+	}
+}
+
+SCENARIO("transform maps values without an inner future", "[composition][shared]") {
+	GIVEN("a pending future") {
+		auto initial = cps::make_future<string>();
+		auto len = initial->transform([](const string &v) { return v.size(); });
+		CHECK(!len->is_ready());
+		WHEN("it completes") {
+			initial->done("four");
+			THEN("the result holds the mapped value") {
+				REQUIRE(len->is_done());
+				CHECK(len->value() == 4u);
+			}
+		}
+		WHEN("it fails") {
+			initial->fail(CustomException { "no value" });
+			THEN("the failure passes through") {
+				REQUIRE(len->is_failed());
+				CHECK(len->exception_ptr() == initial->exception_ptr());
+			}
+		}
+		WHEN("it is cancelled") {
+			initial->cancel();
+			THEN("so is the result") {
+				CHECK(len->is_cancelled());
+			}
+		}
+	}
+	GIVEN("a completed future and a function that throws") {
+		auto len = cps::resolved_future(string("x"))->transform([](const string &) -> int {
+			throw CustomException { "mapping failed" };
+		});
+		THEN("the result is failed") {
+			REQUIRE(len->is_failed());
+			REQUIRE_THROWS_AS(len->value(), CustomException);
+		}
+	}
+}
+
+SCENARIO("transform_error replaces failures with values", "[composition][shared]") {
+	GIVEN("a handler taking the failure reason") {
+		auto initial = cps::make_future<int>();
+		auto seq = initial->transform_error([](const string &reason) { return static_cast<int>(reason.size()); });
+		WHEN("the future fails") {
+			initial->fail(CustomException { "abc" });
+			THEN("we get the mapped value") {
+				REQUIRE(seq->is_done());
+				CHECK(seq->value() == 3);
+			}
+		}
+		WHEN("the future succeeds") {
+			initial->done(10);
+			THEN("the value passes through") {
+				REQUIRE(seq->is_done());
+				CHECK(seq->value() == 10);
+			}
+		}
+	}
+	GIVEN("a handler for a specific exception type") {
+		auto initial = cps::make_future<int>();
+		auto seq = initial->transform_error([](const CustomException &) { return -1; });
+		WHEN("the future fails with that type") {
+			initial->fail(CustomException { "handled" });
+			THEN("we get the mapped value") {
+				REQUIRE(seq->is_done());
+				CHECK(seq->value() == -1);
+			}
+		}
+		WHEN("the future fails with something else") {
+			initial->fail(std::out_of_range("not ours"));
+			THEN("the failure passes through") {
+				REQUIRE(seq->is_failed());
+				REQUIRE_THROWS_AS(seq->value(), std::out_of_range);
+			}
+		}
+	}
+}
@@ -0,0 +1,191 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include "catch.hpp"
+
+#if CPS_FUTURE_HAVE_COROUTINES
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+future_ptr<int> add(future_ptr<int> a, future_ptr<int> b) {
+	auto x = co_await a;
+	auto y = co_await b;
+	co_return x + y;
+}
+
+shared_ptr<future<string>> describe_length(shared_ptr<future<string>> in) {
+	auto s = co_await in;
+	co_return s + " has " + to_string(s.size()) + " characters";
+}
+
+future_ptr<int> count_down(int n) {
+	if(n == 0)
+		co_return 0;
+	auto rest = co_await count_down(n - 1);
+	co_return rest + 1;
+}
+
+template<typename Lazy>
+future_ptr<int> await_one(Lazy work) {
+	co_return co_await std::move(work);
+}
+
+future_ptr<int> await_lazy(future_ptr<int> in, int &started) {
+	auto doubled = co_await lazy_call([&started] { ++started; return 2; })
+		.transform([](int v) { return v * 2; });
+	auto waited = co_await lazy_from(in).transform([](int v) { return v + 1; });
+	co_return doubled + waited;
+}
+
+future_ptr<int> count_pending(future_ptr<int> in, int n) {
+	int total = co_await in;
+	for(int i = 0; i < n; ++i) {
+		auto next = make_future<int>();
+		auto f = next->then([](int v) { return make_future<int>()->done(v + 1); });
+		next->done(total);
+		total = co_await f;
+	}
+	co_return total;
+}
+
+}
+
+SCENARIO("coroutines can await futures and return them", "[coroutine]") {
+	GIVEN("a coroutine waiting on two pending futures") {
+		auto a = make_future<int>();
+		auto b = make_future<int>();
+		auto sum = add(a, b);
+		THEN("it has not finished") {
+			CHECK(!sum->is_ready());
+		}
+		WHEN("both complete") {
+			a->done(2);
+			CHECK(!sum->is_ready());
+			b->done(3);
+			THEN("the coroutine's future has the result") {
+				REQUIRE(sum->is_done());
+				CHECK(sum->value() == 5);
+			}
+		}
+		WHEN("one fails") {
+			a->fail(std::runtime_error("no a"));
+			THEN("so does the coroutine") {
+				REQUIRE(sum->is_failed());
+				CHECK(sum->failure_reason() == "no a");
+			}
+		}
+		WHEN("one is cancelled") {
+			a->done(1);
+			b->cancel();
+			THEN("the coroutine fails") {
+				CHECK(sum->is_failed());
+			}
+		}
+		WHEN("the caller cancels the coroutine's future") {
+			sum->cancel();
+			THEN("the coroutine finishes quietly") {
+				CHECK_NOTHROW(a->done(2));
+				CHECK_NOTHROW(b->done(3));
+				CHECK(sum->is_cancelled());
+			}
+		}
+		WHEN("the caller cancels and then an input fails") {
+			sum->cancel();
+			THEN("the failure is dropped") {
+				CHECK_NOTHROW(a->fail(std::runtime_error("no a")));
+				CHECK(sum->is_cancelled());
+			}
+		}
+	}
+	GIVEN("futures which are already done") {
+		auto sum = add(make_future<int>()->done(4), make_future<int>()->done(5));
+		THEN("the coroutine completes straight away") {
+			REQUIRE(sum->is_done());
+			CHECK(sum->value() == 9);
+		}
+	}
+	GIVEN("a coroutine using the shared_ptr API") {
+		auto in = future<string>::create_shared();
+		auto out = describe_length(in);
+		WHEN("the input completes") {
+			in->done("abc");
+			THEN("we get the result") {
+				REQUIRE(out->is_done());
+				CHECK(out->value() == "abc has 3 characters");
+			}
+		}
+	}
+}
+
+SCENARIO("coroutines can await lazy pipelines", "[coroutine][lazy]") {
+	GIVEN("a lazy pipeline that hasn't been awaited yet") {
+		int started = 0;
+		auto pipeline = lazy_call([&started] { ++started; return 1; });
+		THEN("it hasn't started") {
+			CHECK(started == 0);
+		}
+		WHEN("a coroutine awaits it") {
+			auto f = await_one(std::move(pipeline));
+			THEN("it runs once, and the coroutine has its value") {
+				CHECK(started == 1);
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 1);
+			}
+		}
+	}
+	GIVEN("a coroutine awaiting a ready pipeline and one waiting on a future") {
+		int started = 0;
+		auto in = make_future<int>();
+		auto out = await_lazy(in, started);
+		THEN("the first pipeline ran when awaited, and we're waiting on the second") {
+			CHECK(started == 1);
+			CHECK(!out->is_ready());
+		}
+		WHEN("the future completes") {
+			in->done(10);
+			THEN("the coroutine has both results") {
+				REQUIRE(out->is_done());
+				CHECK(out->value() == 15);
+			}
+		}
+		WHEN("the future fails") {
+			in->fail(std::runtime_error("no input"));
+			THEN("so does the coroutine") {
+				REQUIRE(out->is_failed());
+				CHECK(out->failure_reason() == "no input");
+			}
+		}
+		WHEN("the future is cancelled") {
+			in->cancel();
+			THEN("the coroutine fails") {
+				CHECK(out->is_failed());
+			}
+		}
+	}
+}
+
+SCENARIO("deep coroutine recursion stays within the stack", "[coroutine]") {
+	GIVEN("a coroutine recursing 10000 levels deep") {
+		auto f = count_down(10000);
+		THEN("it completes") {
+			REQUIRE(f->is_done());
+			CHECK(f->value() == 10000);
+		}
+	}
+	GIVEN("a coroutine awaiting 100000 futures in turn") {
+		auto in = make_future<int>();
+		auto f = count_pending(in, 100000);
+		WHEN("the input completes") {
+			in->done(0);
+			THEN("so does the coroutine") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 100000);
+			}
+		}
+	}
+}
+
+#endif
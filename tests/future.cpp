@@ -180,3 +180,366 @@ SCENARIO("cancelled future handling", "[shared]") {
 	}
 }
 
+SCENARIO("resolving a future that may already be resolved", "[shared]") {
+	GIVEN("a cancelled future") {
+		auto f = future<string>::create_shared();
+		int called = 0;
+		f->on_ready([&called](future<string> &) { ++called; });
+		f->cancel();
+		WHEN("we try to resolve it again") {
+			THEN("the try_ forms report that without throwing") {
+				CHECK(!f->try_done("too late"));
+				CHECK(!f->try_fail("too late"));
+				CHECK(!f->try_fail(std::runtime_error("too late")));
+				CHECK(!f->try_fail_exception_pointer(std::make_exception_ptr(std::runtime_error("too late"))));
+				CHECK(!f->try_cancel());
+				AND_THEN("it is still cancelled, and nothing ran twice") {
+					CHECK(f->is_cancelled());
+					CHECK(called == 1);
+				}
+			}
+			AND_THEN("the usual forms still throw") {
+				CHECK_THROWS_AS(f->done("too late"), std::logic_error);
+			}
+		}
+	}
+	GIVEN("a pending future") {
+		auto f = future<string>::create_shared();
+		WHEN("we call try_done") {
+			const bool resolved = f->try_done("ok");
+			THEN("it resolves as done would") {
+				CHECK(resolved);
+				REQUIRE(f->is_done());
+				CHECK(f->value() == "ok");
+			}
+		}
+		WHEN("we call try_fail_from with a failed future") {
+			auto failed = future<int>::create_shared();
+			failed->fail("backend unavailable");
+			const bool resolved = f->try_fail_from(*failed);
+			THEN("it takes on that failure") {
+				CHECK(resolved);
+				REQUIRE(f->is_failed());
+				CHECK(f->failure_reason() == "backend unavailable");
+			}
+		}
+	}
+}
+
+SCENARIO("callbacks run in the order they were added", "[shared]") {
+	GIVEN("a pending future with more callbacks than it can hold inline") {
+		auto f = future<int>::create_shared();
+		std::vector<int> seen;
+		for(int i = 0; i < 8; ++i) {
+			f->on_done([i, &seen](int) {
+				seen.push_back(i);
+			});
+		}
+		WHEN("marked as done") {
+			f->done(1);
+			THEN("every callback ran once, in order") {
+				CHECK(seen == (std::vector<int> { 0, 1, 2, 3, 4, 5, 6, 7 }));
+			}
+		}
+		WHEN("marked as failed") {
+			f->fail("...");
+			THEN("no on_done callbacks ran") {
+				CHECK(seen.empty());
+			}
+		}
+	}
+}
+
+namespace {
+
+/** Counts live instances, and has no default constructor */
+struct tracked {
+	static int live;
+	static int constructed;
+
+	explicit tracked(int v):v(v) { ++live; ++constructed; }
+	tracked(const tracked &src):v(src.v) { ++live; ++constructed; }
+	tracked(tracked &&src):v(src.v) { ++live; ++constructed; }
+	~tracked() { --live; }
+
+	int v;
+};
+
+int tracked::live = 0;
+int tracked::constructed = 0;
+
+}
+
+SCENARIO("values are only constructed on success", "[shared]") {
+	tracked::live = 0;
+	tracked::constructed = 0;
+	GIVEN("a future holding a type with no default constructor") {
+		auto f = future<tracked>::create_ptr();
+		THEN("no value has been constructed yet") {
+			CHECK(tracked::constructed == 0);
+		}
+		WHEN("it fails") {
+			f->fail("no value");
+			THEN("no value was constructed") {
+				CHECK(tracked::constructed == 0);
+			}
+		}
+		WHEN("it is cancelled") {
+			f->cancel();
+			THEN("no value was constructed") {
+				CHECK(tracked::constructed == 0);
+			}
+		}
+		WHEN("it completes") {
+			f->done(tracked { 42 });
+			THEN("the value is available") {
+				CHECK(f->value().v == 42);
+			}
+			f.reset();
+			AND_THEN("the value is destroyed with the future") {
+				CHECK(tracked::live == 0);
+			}
+		}
+		WHEN("it is chained") {
+			auto seq = f->then([](const tracked &t) {
+				return resolved_future(tracked { t.v + 1 });
+			});
+			f->done(tracked { 1 });
+			THEN("the value propagates") {
+				CHECK(seq->value().v == 2);
+			}
+		}
+	}
+	CHECK(tracked::live == 0);
+}
+
+SCENARIO("futures can hold move-only values", "[shared]") {
+	GIVEN("a future holding a unique_ptr") {
+		auto f = future<unique_ptr<int>>::create_ptr();
+		WHEN("it completes") {
+			const int *seen = nullptr;
+			f->on_done([&seen](const unique_ptr<int> &v) {
+				seen = v.get();
+			});
+			auto original = unique_ptr<int>(new int(17));
+			const auto address = original.get();
+			f->done(std::move(original));
+			THEN("on_done handlers see the value without a copy") {
+				CHECK(seen == address);
+			}
+			AND_THEN("get_ref gives us the same object") {
+				CHECK(f->get_ref().get() == address);
+				CHECK(*f->get_ref() == 17);
+			}
+			AND_THEN("we can take the value exactly once") {
+				auto taken = f->take();
+				CHECK(taken.get() == address);
+				REQUIRE_THROWS_AS(f->take(), std::logic_error);
+				REQUIRE_THROWS_AS(f->get_ref(), std::logic_error);
+				CHECK(f->is_done());
+			}
+		}
+		WHEN("it is chained") {
+			auto inner = future<unique_ptr<int>>::create_ptr();
+			auto seq = f->then([inner](const unique_ptr<int> &v) {
+				CHECK(*v == 1);
+				return inner;
+			});
+			f->done(unique_ptr<int>(new int(1)));
+			auto original = unique_ptr<int>(new int(2));
+			const auto address = original.get();
+			inner->done(std::move(original));
+			THEN("the inner value is moved through to the result") {
+				REQUIRE(seq->is_done());
+				CHECK(seq->get_ref().get() == address);
+			}
+		}
+		WHEN("we take from a future that has not completed") {
+			THEN("we get the usual exceptions") {
+				REQUIRE_THROWS_AS(f->take(), std::runtime_error);
+				f->cancel();
+				REQUIRE_THROWS_AS(f->take(), std::runtime_error);
+			}
+		}
+	}
+	GIVEN("a copyable value") {
+		auto f = resolved_future(std::vector<int> { 1, 2, 3 });
+		WHEN("we take it") {
+			auto v = f->take();
+			THEN("the value moves out") {
+				CHECK(v == (std::vector<int> { 1, 2, 3 }));
+				REQUIRE_THROWS_AS(f->value(), std::logic_error);
+			}
+			AND_THEN("the error_code form reports it as taken") {
+				std::error_code ec;
+				CHECK(f->value(ec).empty());
+				CHECK(ec == cps::future_errc::value_taken);
+			}
+		}
+	}
+}
+
+SCENARIO("failure reasons are worked out on demand", "[shared]") {
+	GIVEN("a future failed with a std::exception") {
+		auto f = make_future<int>();
+		f->fail(std::invalid_argument("bad input"));
+		THEN("the reason is the exception's what()") {
+			CHECK(f->failure_reason() == "bad input");
+		}
+		AND_THEN("we get the same string each time") {
+			CHECK(&f->failure_reason() == &f->failure_reason());
+		}
+		AND_THEN("the original exception type is preserved") {
+			REQUIRE_THROWS_AS(f->value(), std::invalid_argument);
+		}
+	}
+	GIVEN("a future failed with something that isn't a std::exception") {
+		auto f = make_future<int>();
+		f->fail(42);
+		THEN("the reason is unknown") {
+			CHECK(f->failure_reason() == "unknown");
+		}
+		AND_THEN("the original value is still available") {
+			REQUIRE_THROWS_AS(f->value(), int);
+		}
+	}
+}
+
+SCENARIO("labels and failures survive without the hot fields", "[shared]") {
+	GIVEN("an unlabelled future") {
+		auto f = make_future<int>();
+		THEN("it has the default label") {
+			CHECK(f->label() == "unlabelled future");
+		}
+		WHEN("we move it") {
+			cps::future<int> moved { std::move(*f) };
+			THEN("the label comes along") {
+				CHECK(moved.label() == "unlabelled future");
+			}
+		}
+	}
+	GIVEN("a labelled future that fails") {
+		auto f = make_future<int>("labelled");
+		f->fail("it broke");
+		WHEN("we move it") {
+			cps::future<int> moved { std::move(*f) };
+			THEN("the label and failure come along") {
+				CHECK(moved.label() == "labelled");
+				CHECK(moved.is_failed());
+				CHECK(moved.failure_reason() == "it broke");
+			}
+			AND_THEN("the original is still failed with the same exception") {
+				REQUIRE(f->is_failed());
+				CHECK(f->failure_reason() == "it broke");
+				CHECK(f->exception_ptr() == moved.exception_ptr());
+			}
+		}
+	}
+}
+
+namespace {
+
+/** Lets us see whether a future has allocated its cold block */
+struct cold_probe : cps::future<int> {
+	using cps::future<int>::future;
+	bool has_cold() const { return cold_.load() != nullptr; }
+};
+
+}
+
+SCENARIO("labels can be literals, interned or copied", "[shared]") {
+	using namespace cps::literals;
+	GIVEN("a future labelled with a literal") {
+		auto f = make_future<int>("literal"_label);
+		THEN("the label is reported") {
+			CHECK(f->label() == "literal");
+			CHECK(f->describe().find("literal (pending)") == 0);
+		}
+	}
+	GIVEN("futures labelled with _label and with a plain string literal") {
+		cold_probe marked { "marked literal"_label };
+		cold_probe plain { "plain literal" };
+		THEN("only the marked one keeps the pointer without a cold block") {
+			CHECK(marked.label() == "marked literal");
+			CHECK(!marked.has_cold());
+			CHECK(plain.label() == "plain literal");
+			CHECK(plain.has_cold());
+		}
+	}
+	GIVEN("a future labelled from a const array that goes away first") {
+		auto make = []() {
+			const char name[] = "from the stack";
+			return make_future<int>(name);
+		};
+		auto f = make();
+		THEN("we kept our own copy") {
+			CHECK(f->label() == "from the stack");
+			CHECK(f->describe().find("from the stack (pending)") == 0);
+		}
+	}
+	GIVEN("a future labelled from a writable buffer") {
+		char buffer[] = "buffer";
+		cold_probe f { buffer };
+		buffer[0] = 'X';
+		THEN("we keep our own copy") {
+			CHECK(f.label() == "buffer");
+			CHECK(f.has_cold());
+		}
+	}
+	GIVEN("a future with an interned label") {
+		auto text = std::string("interned ") + std::to_string(42);
+		auto label = cps::intern_label(text);
+		auto f = make_future<int>(label);
+		text.clear();
+		THEN("the label outlives the original string") {
+			CHECK(f->label() == "interned 42");
+		}
+		AND_THEN("interning the same string again gives the same label") {
+			CHECK(cps::intern_label("interned 42").c_str() == label.c_str());
+		}
+	}
+	GIVEN("a future labelled with a temporary std::string") {
+		auto f = make_future<int>(std::string("temporary ") + std::to_string(1));
+		THEN("we keep our own copy") {
+			CHECK(f->label() == "temporary 1");
+		}
+		WHEN("we move it") {
+			cps::future<int> moved { std::move(*f) };
+			THEN("the new future has the label") {
+				CHECK(moved.label() == "temporary 1");
+			}
+		}
+	}
+}
+
+SCENARIO("timing can be turned off or sampled", "[shared]") {
+	GIVEN("timing turned off") {
+		cps::detail::timing<0> t;
+		t.resolved();
+		THEN("nothing is recorded") {
+			CHECK(!t.enabled());
+			CHECK(t.elapsed(true).count() == 0);
+		}
+	}
+	GIVEN("one in three futures sampled") {
+		std::vector<cps::detail::timing<3>> timings(9);
+		THEN("we time every third one") {
+			size_t enabled = 0;
+			for(auto &t : timings) {
+				if(t.enabled())
+					++enabled;
+				else
+					CHECK(t.elapsed(false).count() == 0);
+			}
+			CHECK(enabled == 3);
+		}
+	}
+}
+
+SCENARIO("the hot fields of a small future share a cache line", "[shared]") {
+	GIVEN("a future<int>") {
+		THEN("everything except the inline task slots fits in 64 bytes") {
+			CHECK(sizeof(cps::future<int>) - CPS_FUTURE_INLINE_TASKS * CPS_FUTURE_INLINE_TASK_SIZE <= 64);
+		}
+	}
+}
@@ -0,0 +1,71 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("future_ptr reference counting", "[future_ptr]") {
+	GIVEN("a future created via create_ptr") {
+		auto f = future<int>::create_ptr("counted");
+		REQUIRE(f);
+		CHECK(f.use_count() == 1);
+		CHECK(f->label() == "counted");
+		WHEN("we copy the handle") {
+			auto copy = f;
+			THEN("both refer to the same future") {
+				CHECK(copy == f);
+				CHECK(f.use_count() == 2);
+			}
+			copy.reset();
+			AND_THEN("dropping the copy releases its reference") {
+				CHECK(!copy);
+				CHECK(f.use_count() == 1);
+			}
+		}
+		WHEN("we chain calls") {
+			auto same = f->on_done([](int) { })->done(5);
+			THEN("we get a handle to the original future back") {
+				CHECK(same == f);
+				CHECK(same->value() == 5);
+			}
+		}
+		WHEN("we convert to a shared_ptr") {
+			std::shared_ptr<future<int>> shared = f;
+			THEN("it shares ownership with the handle") {
+				CHECK(shared.get() == f.get());
+				CHECK(f.use_count() == 2);
+			}
+			f.reset();
+			AND_THEN("the future outlives the original handle") {
+				CHECK(shared->is_pending());
+				shared->done(7);
+				CHECK(shared->value() == 7);
+			}
+		}
+	}
+	GIVEN("a pending future holding callbacks") {
+		auto tracker = make_shared<int>(0);
+		weak_ptr<int> weak { tracker };
+		auto f = make_future<int>();
+		f->on_done([tracker](int) { });
+		tracker.reset();
+		WHEN("the last handle goes away") {
+			f.reset();
+			THEN("the future is destroyed along with its callbacks") {
+				CHECK(weak.expired());
+			}
+		}
+	}
+	GIVEN("a future that is not owned by any handle") {
+		future<int> local;
+		WHEN("we take and drop handles to it") {
+			local.ptr()->done(3);
+			THEN("it is still intact") {
+				CHECK(local.use_count() == 1);
+				CHECK(local.value() == 3);
+			}
+		}
+	}
+}
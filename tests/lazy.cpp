@@ -0,0 +1,160 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include <memory>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/** Records whichever outcome it was given */
+template<typename T>
+struct recorder {
+	struct outcome {
+		int calls = 0;
+		bool has_value = false;
+		T value { };
+		std::exception_ptr ex;
+		bool cancelled = false;
+	};
+	shared_ptr<outcome> out = make_shared<outcome>();
+
+	void set_value(T v) { ++out->calls; out->has_value = true; out->value = std::move(v); }
+	void set_error(std::exception_ptr e) { ++out->calls; out->ex = e; }
+	void set_cancelled() { ++out->calls; out->cancelled = true; }
+};
+
+}
+
+SCENARIO("lazy pipelines do nothing until started", "[lazy]") {
+	GIVEN("a lazy_call with two transform steps") {
+		int calls = 0;
+		auto pipeline = lazy_call([&calls] { ++calls; return string("abc"); })
+			.transform([&calls](const string &s) { ++calls; return s.size(); })
+			.transform([&calls](size_t n) { ++calls; return static_cast<int>(n) * 2; });
+		THEN("nothing has run yet") {
+			CHECK(calls == 0);
+		}
+		WHEN("we start it with a receiver") {
+			recorder<int> r;
+			std::move(pipeline).start(r);
+			THEN("every step ran and the receiver has the value") {
+				CHECK(calls == 3);
+				CHECK(r.out->calls == 1);
+				REQUIRE(r.out->has_value);
+				CHECK(r.out->value == 6);
+			}
+		}
+		WHEN("we convert it to a future") {
+			auto f = std::move(pipeline).future();
+			THEN("the future has the value") {
+				CHECK(calls == 3);
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 6);
+			}
+		}
+	}
+}
+
+SCENARIO("lazy pipelines report errors", "[lazy]") {
+	GIVEN("a pipeline where a step throws") {
+		bool later = false;
+		auto pipeline = lazy_value(1)
+			.transform([](int) -> int { throw std::runtime_error("step failed"); })
+			.transform([&later](int v) { later = true; return v; });
+		WHEN("we convert it to a future") {
+			auto f = std::move(pipeline).future();
+			THEN("the future failed and later steps were skipped") {
+				CHECK(!later);
+				REQUIRE(f->is_failed());
+				CHECK(f->failure_reason() == "step failed");
+			}
+		}
+	}
+	GIVEN("a lazy_call which throws") {
+		auto pipeline = lazy_call([]() -> string { throw std::runtime_error("no config"); });
+		WHEN("we start it with a receiver") {
+			recorder<string> r;
+			std::move(pipeline).start(r);
+			THEN("the receiver gets the exception") {
+				CHECK(r.out->calls == 1);
+				CHECK(!r.out->has_value);
+				CHECK(r.out->ex);
+			}
+		}
+	}
+	GIVEN("a receiver which throws from set_value") {
+		struct throwing_receiver {
+			int *errors;
+			void set_value(int) { throw std::logic_error("receiver failed"); }
+			void set_error(std::exception_ptr) { ++*errors; }
+			void set_cancelled() { }
+		};
+		int errors = 0;
+		THEN("the exception propagates rather than going to set_error") {
+			CHECK_THROWS_AS(lazy_value(1).transform([](int v) { return v + 1; }).start(throwing_receiver { &errors }), std::logic_error);
+			CHECK(errors == 0);
+		}
+	}
+}
+
+SCENARIO("lazy pipelines can wait on classic futures", "[lazy]") {
+	GIVEN("a pending future wrapped with lazy_from") {
+		auto source = make_future<int>();
+		auto f = lazy_from(source)
+			.transform([](int v) { return v * 10; })
+			.future();
+		THEN("the result waits for the source") {
+			CHECK(!f->is_ready());
+		}
+		WHEN("the source completes") {
+			source->done(4);
+			THEN("the result has the transformed value") {
+				REQUIRE(f->is_done());
+				CHECK(f->value() == 40);
+			}
+		}
+		WHEN("the source fails") {
+			source->fail("upstream");
+			THEN("so does the result") {
+				REQUIRE(f->is_failed());
+				CHECK(f->failure_reason() == "upstream");
+			}
+		}
+		WHEN("the source is cancelled") {
+			source->cancel();
+			THEN("so is the result") {
+				CHECK(f->is_cancelled());
+			}
+		}
+		WHEN("the result is cancelled before the source completes") {
+			f->cancel();
+			THEN("the source's value is dropped") {
+				CHECK_NOTHROW(source->done(4));
+				CHECK(f->is_cancelled());
+			}
+		}
+		WHEN("the result is cancelled before the source fails") {
+			f->cancel();
+			THEN("the failure is dropped") {
+				CHECK_NOTHROW(source->fail("upstream"));
+				CHECK(f->is_cancelled());
+			}
+		}
+	}
+	GIVEN("a future holding a move-only value") {
+		auto source = make_future<unique_ptr<int>>();
+		auto f = lazy_from(source)
+			.transform([](const unique_ptr<int> &p) { return *p; })
+			.future();
+		WHEN("the source completes") {
+			source->done(unique_ptr<int>(new int(9)));
+			THEN("the value was passed through") {
+				CHECK(f->value() == 9);
+			}
+		}
+	}
+}
@@ -14,7 +14,7 @@ namespace rc {
 template<typename T>
 struct Arbitrary<std::shared_ptr<cps::future<T>>> {
 	static Gen<std::shared_ptr<cps::future<T>>> arbitrary() {
-		return gen::exec([] {
+		return gen::exec([]() -> std::shared_ptr<cps::future<T>> {
 			auto f = cps::make_future<T>(*gen::arbitrary<std::string>());
 			switch(*rc::gen::inRange(0, 3)) {
 			case 0:
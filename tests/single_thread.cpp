@@ -0,0 +1,63 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+using local_future = future<int, single_thread>;
+
+SCENARIO("futures with the single_thread policy", "[single_thread]") {
+	GIVEN("a single-threaded future") {
+		auto f = local_future::create_ptr("local");
+		CHECK(f.use_count() == 1);
+		CHECK(f->label() == "local");
+		WHEN("we register callbacks and mark it done") {
+			std::vector<int> seen;
+			f->on_done([&seen](int v) { seen.push_back(v); })
+			 ->on_ready([&seen](local_future &in) { seen.push_back(in.value() * 2); })
+			 ->done(21);
+			THEN("they run in order") {
+				REQUIRE(seen.size() == 2);
+				CHECK(seen[0] == 21);
+				CHECK(seen[1] == 42);
+			}
+		}
+		WHEN("we fail it") {
+			f->fail(std::runtime_error("no threads here"));
+			THEN("the failure is reported as usual") {
+				CHECK(f->is_failed());
+				CHECK(f->failure_reason() == "no threads here");
+				REQUIRE_THROWS_AS(f->value(), std::runtime_error);
+			}
+		}
+		WHEN("we chain with ->then") {
+			auto seq = f->then([](int v) {
+				return future<std::string, single_thread>::create_ptr()->done(std::to_string(v));
+			});
+			f->done(7);
+			THEN("the result comes through") {
+				REQUIRE(seq->is_done());
+				CHECK(seq->value() == "7");
+			}
+		}
+		WHEN("we take more handles") {
+			auto copy = f;
+			std::shared_ptr<local_future> shared = f;
+			THEN("the count goes up") {
+				CHECK(f.use_count() == 3);
+			}
+		}
+	}
+	GIVEN("a single-threaded future that we cancel") {
+		auto f = local_future::create_ptr();
+		bool cancelled = false;
+		f->on_cancel([&cancelled] { cancelled = true; });
+		f->cancel();
+		THEN("the cancel handler runs") {
+			CHECK(cancelled);
+			CHECK(f->is_cancelled());
+		}
+	}
+}
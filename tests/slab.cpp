@@ -0,0 +1,108 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include <thread>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/** Counts everything it hands out, so we can see the future went through us */
+template<typename T>
+struct counting_allocator {
+	using value_type = T;
+
+	counting_allocator(int &live):live(&live) { }
+	template<typename U>
+	counting_allocator(const counting_allocator<U> &src):live(src.live) { }
+
+	T *allocate(std::size_t n) {
+		++*live;
+		return std::allocator<T>().allocate(n);
+	}
+	void deallocate(T *p, std::size_t n) {
+		--*live;
+		std::allocator<T>().deallocate(p, n);
+	}
+
+	int *live;
+};
+
+template<typename T, typename U>
+bool operator==(const counting_allocator<T> &a, const counting_allocator<U> &b) { return a.live == b.live; }
+template<typename T, typename U>
+bool operator!=(const counting_allocator<T> &a, const counting_allocator<U> &b) { return a.live != b.live; }
+
+}
+
+SCENARIO("futures from an allocator", "[slab]") {
+	GIVEN("a counting allocator") {
+		int live = 0;
+		WHEN("we create a future with it") {
+			auto f = make_future<int>(std::allocator_arg, counting_allocator<int>(live), "allocated");
+			THEN("the memory came from the allocator") {
+				CHECK(live == 1);
+				CHECK(f->label() == "allocated");
+			}
+			f->done(3);
+			f.reset();
+			AND_THEN("it goes back when the last handle does") {
+				CHECK(live == 0);
+			}
+		}
+		WHEN("we use the shared_ptr API") {
+			auto f = future<int>::create_shared(std::allocator_arg, counting_allocator<int>(live));
+			f->done(4);
+			CHECK(live == 1);
+			f.reset();
+			THEN("the memory still goes back") {
+				CHECK(live == 0);
+			}
+		}
+	}
+}
+
+SCENARIO("slab allocation", "[slab]") {
+	GIVEN("a future from the slab allocator") {
+		auto f = make_future<int>(std::allocator_arg, slab_allocator<int>());
+		auto address = f.get();
+		f->done(5);
+		CHECK(f->value() == 5);
+		WHEN("we release it and make another") {
+			f.reset();
+			auto g = make_future<int>(std::allocator_arg, slab_allocator<int>());
+			THEN("the block is reused") {
+				CHECK(g.get() == address);
+			}
+		}
+		WHEN("another thread releases it") {
+			std::thread([f]() mutable { f.reset(); }).join();
+			f.reset();
+			auto g = make_future<int>(std::allocator_arg, slab_allocator<int>());
+			THEN("the block comes back to this thread once we run out") {
+				std::vector<future_ptr<int>> more;
+				bool seen = g.get() == address;
+				for(int i = 0; i < 200 && !seen; ++i) {
+					more.push_back(make_future<int>(std::allocator_arg, slab_allocator<int>()));
+					seen = more.back().get() == address;
+				}
+				CHECK(seen);
+			}
+		}
+		WHEN("a thread which never allocates frees it") {
+			std::thread([g = std::move(f)]() mutable { g.reset(); }).join();
+			THEN("the block still comes back to this thread") {
+				std::vector<future_ptr<int>> more;
+				bool seen = false;
+				for(int i = 0; i < 200 && !seen; ++i) {
+					more.push_back(make_future<int>(std::allocator_arg, slab_allocator<int>()));
+					seen = more.back().get() == address;
+				}
+				CHECK(seen);
+			}
+		}
+	}
+}
@@ -0,0 +1,481 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+namespace {
+
+/** Spins until the flag is raised, so that all our threads start at roughly the same time */
+void wait_for(const atomic<bool> &go) {
+	while(!go.load(memory_order_acquire))
+		this_thread::yield();
+}
+
+/** A value which takes a while to copy, so that a cancel can land in the middle */
+struct slow_copy {
+	explicit slow_copy(int v):value(v) { }
+	slow_copy(const slow_copy &src):value(src.value) { this_thread::sleep_for(chrono::microseconds(50)); }
+	slow_copy(slow_copy &&src) = default;
+	slow_copy &operator=(const slow_copy &) = default;
+	slow_copy &operator=(slow_copy &&) = default;
+
+	int value;
+};
+
+/** What went wrong across every round of race_with_cancel */
+struct cancel_race {
+	/** Exceptions from resolving an input or cancelling the result */
+	int errors = 0;
+	/** Results still pending once everything had finished */
+	int unresolved = 0;
+	/** Results whose on_ready handler didn't run exactly once */
+	int wrong_calls = 0;
+};
+
+/**
+ * Builds a combinator over four inputs, then resolves each input on a
+ * thread of its own while another thread cancels the result. Every
+ * seventh round, one input fails rather than succeeding.
+ *
+ * The canceller waits until some of the inputs are ready - one of
+ * them in the first round, two in the next and so on - so that it
+ * lands while their callbacks are still busy with the result.
+ */
+template<typename Combine>
+cancel_race race_with_cancel(Combine combine) {
+	const int inputs = 4;
+	cancel_race outcome;
+	for(int iteration = 0; iteration < 500; ++iteration) {
+		vector<shared_ptr<future<int>>> items;
+		for(int i = 0; i < inputs; ++i)
+			items.push_back(future<int>::create_shared());
+		auto result = combine(items);
+		using result_type = typename std::decay<decltype(*result)>::type;
+		atomic<int> called { 0 };
+		result->on_ready([&called](result_type &) { ++called; });
+		atomic<bool> go { false };
+		atomic<int> errors { 0 };
+		vector<thread> threads;
+		for(int t = 0; t < inputs; ++t) {
+			threads.emplace_back([&, t] {
+				wait_for(go);
+				try {
+					if(iteration % 7 == 0 && t == 0)
+						items[t]->fail("shard unavailable");
+					else
+						items[t]->done(t);
+				} catch(...) {
+					++errors;
+				}
+			});
+		}
+		threads.emplace_back([&] {
+			wait_for(go);
+			const auto wanted = iteration % inputs + 1;
+			while(std::count_if(items.begin(), items.end(), [](const shared_ptr<future<int>> &f) { return f->is_ready(); }) < wanted)
+				this_thread::yield();
+			try {
+				result->try_cancel();
+			} catch(...) {
+				++errors;
+			}
+		});
+		go = true;
+		for(auto &t : threads)
+			t.join();
+		outcome.errors += errors;
+		if(!result->is_ready())
+			++outcome.unresolved;
+		if(called != 1)
+			++outcome.wrong_calls;
+	}
+	return outcome;
+}
+
+}
+
+SCENARIO("registration races with resolution", "[threads]") {
+	const int thread_count = 4;
+	const int per_thread = 250;
+	for(int iteration = 0; iteration < 20; ++iteration) {
+		auto f = future<int>::create_shared();
+		atomic<bool> go { false };
+		atomic<int> called { 0 };
+		atomic<int> wrong_value { 0 };
+		vector<thread> threads;
+		for(int t = 0; t < thread_count; ++t) {
+			threads.emplace_back([&] {
+				wait_for(go);
+				for(int i = 0; i < per_thread; ++i) {
+					f->on_done([&](int v) {
+						if(v != 123) ++wrong_value;
+						++called;
+					});
+				}
+			});
+		}
+		threads.emplace_back([&] {
+			wait_for(go);
+			f->done(123);
+		});
+		go = true;
+		for(auto &t : threads)
+			t.join();
+		CHECK(f->is_done());
+		CHECK(called == thread_count * per_thread);
+		CHECK(wrong_value == 0);
+	}
+}
+
+SCENARIO("concurrent resolvers", "[threads]") {
+	const int thread_count = 4;
+	for(int iteration = 0; iteration < 100; ++iteration) {
+		auto f = future<int>::create_shared();
+		atomic<bool> go { false };
+		atomic<int> resolved { 0 };
+		atomic<int> rejected { 0 };
+		atomic<int> called { 0 };
+		f->on_ready([&](future<int> &) { ++called; });
+		vector<thread> threads;
+		for(int t = 0; t < thread_count; ++t) {
+			threads.emplace_back([&, t] {
+				wait_for(go);
+				try {
+					if(t % 2)
+						f->done(t);
+					else
+						f->cancel();
+					++resolved;
+				} catch(const std::logic_error &) {
+					++rejected;
+				}
+			});
+		}
+		go = true;
+		for(auto &t : threads)
+			t.join();
+		CHECK(f->is_ready());
+		CHECK(resolved == 1);
+		CHECK(rejected == thread_count - 1);
+		CHECK(called == 1);
+	}
+}
+
+SCENARIO("combinators with inputs resolved on several threads", "[threads][composed]") {
+	const int thread_count = 4;
+	const int per_thread = 250;
+	for(int iteration = 0; iteration < 20; ++iteration) {
+		vector<shared_ptr<future<int>>> items;
+		for(int i = 0; i < thread_count * per_thread; ++i)
+			items.push_back(future<int>::create_shared());
+		auto all = needs_all(items);
+		auto any = needs_any(items);
+		auto values = gather(items);
+		atomic<bool> go { false };
+		atomic<int> errors { 0 };
+		vector<thread> threads;
+		for(int t = 0; t < thread_count; ++t) {
+			threads.emplace_back([&, t] {
+				wait_for(go);
+				for(int i = t * per_thread; i < (t + 1) * per_thread; ++i) {
+					try {
+						/* One failure in the last iteration, so both outcomes get exercised */
+						if(iteration == 19 && i == per_thread)
+							items[i]->fail("shard unavailable");
+						else
+							items[i]->done(i);
+					} catch(...) {
+						++errors;
+					}
+				}
+			});
+		}
+		go = true;
+		for(auto &t : threads)
+			t.join();
+		CHECK(errors == 0);
+		CHECK(any->is_ready());
+		REQUIRE(all->is_ready());
+		CHECK(all->is_done() == (iteration != 19));
+		REQUIRE(values->is_ready());
+		if(iteration != 19) {
+			REQUIRE(values->is_done());
+			auto &v = values->get_ref();
+			int mismatched = 0;
+			for(int i = 0; i < thread_count * per_thread; ++i)
+				if(v[i] != i) ++mismatched;
+			CHECK(mismatched == 0);
+		} else {
+			CHECK(values->failure_reason() == "shard unavailable");
+		}
+	}
+}
+
+SCENARIO("cancelling combinators while their inputs resolve", "[threads][composed]") {
+	GIVEN("variadic needs_all") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			return needs_all(in[0], in[1], in[2], in[3]);
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+	GIVEN("needs_all of a single future") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			return needs_all(in[0]);
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+	GIVEN("needs_all over a vector") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			return needs_all(in);
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+	GIVEN("needs_any over a vector") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			return needs_any(in);
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+	GIVEN("variadic needs_any") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			return needs_any(in[0], in[1], in[2], in[3]);
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+	GIVEN("gather over a vector") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			return gather(in);
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+	GIVEN("gather into a tuple") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			return gather(in[0], in[1], in[2], in[3]);
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+	GIVEN("needs_all_into caller storage") {
+		/* Inputs may still write here after a cancel, so it has to outlive them all */
+		vector<int> storage(4);
+		const auto outcome = race_with_cancel([&storage](const vector<shared_ptr<future<int>>> &in) {
+			return needs_all_into(in, storage.data());
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+}
+
+SCENARIO("cancelling continuations while their source resolves", "[threads][composed]") {
+	GIVEN("->transform") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			/* Taking a while gives the cancel a chance to land in the middle */
+			return in[0]->transform([](int v) {
+				this_thread::sleep_for(chrono::microseconds(50));
+				return v + 1;
+			});
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+	GIVEN("->transform_error") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			return in[0]->transform_error([](const std::string &) {
+				this_thread::sleep_for(chrono::microseconds(50));
+				return -1;
+			});
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+}
+
+SCENARIO("cancelling ->then while the inner future resolves", "[threads][composed]") {
+	GIVEN("->then returning a future that another input resolves") {
+		const auto outcome = race_with_cancel([](const vector<shared_ptr<future<int>>> &in) {
+			/* The result cancels the inner future, so in[1] only tries to resolve it */
+			auto inner = make_future<slow_copy>();
+			in[1]->on_done([inner](int v) { inner->try_done(slow_copy { v }); });
+			return in[0]->then([inner](int) { return inner; });
+		});
+		THEN("whichever side loses leaves the result alone") {
+			CHECK(outcome.errors == 0);
+			CHECK(outcome.unresolved == 0);
+			CHECK(outcome.wrong_calls == 0);
+		}
+	}
+}
+
+SCENARIO("pending tasks are released with their future", "[threads]") {
+	GIVEN("a future with callbacks that is never resolved") {
+		auto tracker = make_shared<int>(0);
+		weak_ptr<int> weak { tracker };
+		{
+			auto f = future<int>::create_shared();
+			f->on_done([tracker](int) { });
+			f->on_ready([tracker](future<int> &) { });
+			tracker.reset();
+			CHECK(!weak.expired());
+		}
+		THEN("the captures are destroyed") {
+			CHECK(weak.expired());
+		}
+	}
+}
+
+SCENARIO("moving futures from several threads at once", "[threads]") {
+	GIVEN("labelled futures, each with its own construction lock") {
+		const int count = 2000;
+		const int movers = 4;
+		std::vector<future_ptr<int>> sources;
+		for(int i = 0; i < count; ++i)
+			sources.push_back(make_future<int>(std::string("source ") + to_string(i))->done(i));
+		std::vector<atomic<int>> kept_label(count);
+		atomic<int> wrong { 0 };
+		atomic<bool> start { false };
+		vector<thread> moving;
+		for(int t = 0; t < movers; ++t) {
+			moving.emplace_back([&] {
+				wait_for(start);
+				for(int i = 0; i < count; ++i) {
+					future<int> moved { std::move(*sources[i]) };
+					if(!moved.is_done() || moved.value() != i)
+						++wrong;
+					if(moved.label() == "source " + to_string(i))
+						++kept_label[i];
+					else if(moved.label() != "unlabelled future")
+						++wrong;
+				}
+			});
+		}
+		start = true;
+		for(auto &t : moving)
+			t.join();
+		THEN("every move sees the value, and exactly one takes each label") {
+			CHECK(wrong == 0);
+			int once = 0;
+			for(auto &k : kept_label)
+				if(k == 1) ++once;
+			CHECK(once == count);
+		}
+	}
+}
+
+SCENARIO("moving futures that share a lock pool", "[threads]") {
+	using striped = future<int, striped_multi_thread<4>>;
+	GIVEN("a pool with fewer locks than futures") {
+		std::vector<striped> futures(16);
+		THEN("the futures are spread over more than one lock, and some share") {
+			std::set<detail::spinlock *> locks;
+			for(auto &f : futures)
+				locks.insert(&striped_multi_thread<4>::lock_for(&f));
+			CHECK(locks.size() > 1);
+			CHECK(locks.size() < futures.size());
+		}
+	}
+	GIVEN("labelled futures which several threads move from at once") {
+		const int count = 5000;
+		const int movers = 4;
+		std::vector<future_ptr<int, striped_multi_thread<4>>> sources;
+		for(int i = 0; i < count; ++i)
+			sources.push_back(striped::create_ptr(std::string("source ") + to_string(i))->done(i));
+		std::vector<atomic<int>> kept_label(count);
+		atomic<int> wrong { 0 };
+		atomic<bool> start { false };
+		vector<thread> moving;
+		for(int t = 0; t < movers; ++t) {
+			moving.emplace_back([&] {
+				wait_for(start);
+				for(int i = 0; i < count; ++i) {
+					striped moved { std::move(*sources[i]) };
+					if(!moved.is_done() || moved.value() != i)
+						++wrong;
+					if(moved.label() == "source " + to_string(i))
+						++kept_label[i];
+					else if(moved.label() != "unlabelled future")
+						++wrong;
+				}
+			});
+		}
+		start = true;
+		for(auto &t : moving)
+			t.join();
+		THEN("every move sees the value, and exactly one takes each label") {
+			CHECK(wrong == 0);
+			int once = 0;
+			for(auto &k : kept_label)
+				if(k == 1) ++once;
+			CHECK(once == count);
+		}
+	}
+	GIVEN("several threads each creating and moving their own futures") {
+		const int thread_count = 4;
+		const int per_thread = 200;
+		atomic<bool> go { false };
+		atomic<int> wrong_value { 0 };
+		vector<thread> threads;
+		for(int t = 0; t < thread_count; ++t) {
+			threads.emplace_back([&, t] {
+				wait_for(go);
+				for(int i = 0; i < per_thread; ++i) {
+					auto f = striped::create_ptr();
+					f->done(t * per_thread + i);
+					striped moved { std::move(*f) };
+					if(moved.value() != t * per_thread + i)
+						++wrong_value;
+				}
+			});
+		}
+		go = true;
+		for(auto &t : threads)
+			t.join();
+		THEN("every move sees its own value, whichever lock it shares") {
+			CHECK(wrong_value == 0);
+		}
+	}
+}
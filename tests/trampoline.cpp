@@ -0,0 +1,155 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include <algorithm>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("long ->then chains do not overflow the stack", "[composed][trampoline]") {
+	GIVEN("a pending future with 100000 ->then links after it") {
+		const int links = 100000;
+		auto initial = make_future<int>();
+		auto last = initial;
+		for(int i = 0; i < links; ++i) {
+			last = last->then([](int v) {
+				return make_future<int>()->done(v + 1);
+			});
+		}
+		WHEN("we resolve the first one") {
+			initial->done(0);
+			THEN("every link ran before done() returned") {
+				REQUIRE(last->is_done());
+				CHECK(last->value() == links);
+			}
+		}
+	}
+	GIVEN("a pending future with 100000 on_ready handlers each resolving the next") {
+		const int links = 100000;
+		vector<shared_ptr<future<int>>> chain;
+		for(int i = 0; i <= links; ++i)
+			chain.push_back(make_future<int>());
+		for(int i = 0; i < links; ++i) {
+			auto next = chain[i + 1];
+			chain[i]->on_done([next](int v) {
+				next->done(v + 1);
+			});
+		}
+		WHEN("we resolve the first one") {
+			chain.front()->done(0);
+			THEN("the last one has the value") {
+				REQUIRE(chain.back()->is_done());
+				CHECK(chain.back()->value() == links);
+			}
+		}
+	}
+}
+
+SCENARIO("nested resolution keeps callback order", "[composed][trampoline]") {
+	GIVEN("a chain deeper than the trampoline limit, with two handlers on each future") {
+		const int links = CPS_FUTURE_TRAMPOLINE_DEPTH * 4;
+		vector<shared_ptr<future<int>>> chain;
+		for(int i = 0; i <= links; ++i)
+			chain.push_back(make_future<int>());
+		/* 1 once the first handler has run, 2 once the second has run after it */
+		vector<int> step(links, 0);
+		for(int i = 0; i < links; ++i) {
+			auto next = chain[i + 1];
+			chain[i]->on_done([next, &step](int v) {
+				if(step[v] == 0)
+					step[v] = 1;
+				next->done(v + 1);
+			});
+			chain[i]->on_done([&step](int v) {
+				if(step[v] == 1)
+					step[v] = 2;
+			});
+		}
+		WHEN("we resolve the first one") {
+			chain.front()->done(0);
+			THEN("every future's handlers ran, in registration order") {
+				CHECK(std::count(step.begin(), step.end(), 2) == links);
+			}
+		}
+	}
+}
+
+SCENARIO("exceptions from queued callbacks reach the outermost caller", "[composed][trampoline]") {
+	GIVEN("a chain deeper than the trampoline limit with a throwing handler at the end") {
+		const int links = CPS_FUTURE_TRAMPOLINE_DEPTH * 2;
+		vector<shared_ptr<future<int>>> chain;
+		for(int i = 0; i <= links; ++i)
+			chain.push_back(make_future<int>());
+		for(int i = 0; i < links; ++i) {
+			auto next = chain[i + 1];
+			chain[i]->on_done([next](int v) {
+				next->done(v + 1);
+			});
+		}
+		chain.back()->on_done([](int) {
+			throw std::runtime_error("handler failed");
+		});
+		WHEN("we resolve the first one") {
+			THEN("done() throws") {
+				CHECK_THROWS_AS(chain.front()->done(0), std::runtime_error);
+				AND_THEN("the last future was still resolved") {
+					CHECK(chain.back()->is_done());
+				}
+			}
+		}
+		AND_WHEN("we resolve another chain afterwards") {
+			CHECK_THROWS(chain.front()->done(0));
+			auto f = make_future<int>();
+			auto g = f->then([](int v) {
+				return make_future<int>()->done(v * 2);
+			});
+			f->done(21);
+			THEN("it still completes") {
+				CHECK(g->is_done());
+				CHECK(g->value() == 42);
+			}
+		}
+	}
+}
+
+/** Resolves a future on the stack from inside the callbacks of the one before, depth times over */
+static bool resolve_nested_on_stack(int depth) {
+	bool ran = false;
+	future<int> local;
+	local.on_done([&ran, depth](int) {
+		ran = depth == 0 || resolve_nested_on_stack(depth - 1);
+	});
+	local.done(depth);
+	/* A queued callback would only run after we've returned and local has gone */
+	return ran;
+}
+
+/** As resolve_nested_on_stack, for futures in a unique_ptr */
+static bool resolve_nested_in_unique_ptr(int depth) {
+	bool ran = false;
+	auto local = future<int>::create();
+	local->on_done([&ran, depth](int) {
+		ran = depth == 0 || resolve_nested_in_unique_ptr(depth - 1);
+	});
+	local->done(depth);
+	return ran;
+}
+
+SCENARIO("futures not owned by handles are never queued", "[composed][trampoline]") {
+	GIVEN("futures on the stack, each resolved from the previous one's callback") {
+		WHEN("we nest them deeper than the trampoline limit") {
+			THEN("every callback ran inside its done()") {
+				CHECK(resolve_nested_on_stack(CPS_FUTURE_TRAMPOLINE_DEPTH * 2));
+			}
+		}
+	}
+	GIVEN("futures in unique_ptrs from create(), each resolved from the previous one's callback") {
+		WHEN("we nest them deeper than the trampoline limit") {
+			THEN("every callback ran inside its done()") {
+				CHECK(resolve_nested_in_unique_ptr(CPS_FUTURE_TRAMPOLINE_DEPTH * 2));
+			}
+		}
+	}
+}
@@ -0,0 +1,87 @@
+#define FUTURE_TRACE 0
+#include <cps/future.h>
+
+#include <array>
+
+#include "catch.hpp"
+
+using namespace cps;
+using namespace std;
+
+SCENARIO("unique_function holds move-only callables", "[unique_function]") {
+	GIVEN("a lambda owning a unique_ptr") {
+		auto p = std::unique_ptr<int>(new int(7));
+		unique_function<int(int)> code { [p = std::move(p)](int v) { return *p + v; } };
+		THEN("we can call it") {
+			REQUIRE(code);
+			CHECK(code(3) == 10);
+		}
+		WHEN("we move it") {
+			auto moved = std::move(code);
+			THEN("the target comes along") {
+				CHECK(!code);
+				CHECK(moved(1) == 8);
+			}
+		}
+	}
+	GIVEN("a callable too large to store inline") {
+		std::array<int, 32> big;
+		big.fill(2);
+		unique_function<int()> code { [big] { return big[0] + big[31]; } };
+		auto moved = std::move(code);
+		THEN("it still works") {
+			CHECK(moved() == 4);
+		}
+	}
+	GIVEN("an empty unique_function") {
+		unique_function<void()> code;
+		THEN("calling it throws") {
+			CHECK(!code);
+			REQUIRE_THROWS_AS(code(), std::bad_function_call);
+		}
+	}
+}
+
+SCENARIO("handlers can be any callable", "[unique_function]") {
+	GIVEN("a pending future") {
+		auto f = make_future<int>();
+		WHEN("we register a move-only on_done handler") {
+			int seen = 0;
+			auto p = std::unique_ptr<int>(new int(100));
+			f->on_done([&seen, p = std::move(p)](int v) { seen = *p + v; });
+			f->done(5);
+			THEN("it runs") {
+				CHECK(seen == 105);
+			}
+		}
+		WHEN("we register cancel handlers with and without the future") {
+			int calls = 0;
+			f->on_cancel([&calls] { ++calls; })
+			 ->on_cancel([&calls](future<int> &in) { if(in.is_cancelled()) ++calls; });
+			f->cancel();
+			THEN("both run") {
+				CHECK(calls == 2);
+			}
+		}
+		WHEN("we pass a std::function or unique_function") {
+			int calls = 0;
+			std::function<void(int)> a = [&calls](int) { ++calls; };
+			unique_function<void(int)> b { [&calls](int) { ++calls; } };
+			f->on_done(a)->on_done(std::move(b))->done(1);
+			THEN("they run too") {
+				CHECK(calls == 2);
+			}
+		}
+		WHEN("we chain with a move-only callback") {
+			auto p = std::unique_ptr<int>(new int(3));
+			auto seq = f->then([p = std::move(p)](int v) {
+				return resolved_future(v * *p);
+			});
+			f->done(4);
+			THEN("the result comes through") {
+				REQUIRE(seq->is_done());
+				CHECK(seq->value() == 12);
+			}
+		}
+	}
+}
@@ -1,6 +1,10 @@
 #define FUTURE_TRACE 0
 #include <cps/future.h>
 
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+
 #include "catch.hpp"
 
 using namespace cps;
@@ -99,6 +103,440 @@ SCENARIO("needs_all", "[composed][shared]") {
 				CHECK(na->is_failed());
 			}
 		}
+		WHEN("needs_all is cancelled before the dependents finish") {
+			na->cancel();
+			THEN("they can still complete or fail") {
+				CHECK_NOTHROW(f1->done(34));
+				CHECK_NOTHROW(f2->fail("..."));
+				CHECK(na->is_cancelled());
+			}
+		}
+	}
+}
+
+
+SCENARIO("needs_all with futures that are already ready", "[composed][shared]") {
+	GIVEN("two resolved futures") {
+		std::shared_ptr<future<int>> f1 = future<int>::create_ptr()->done(1);
+		std::shared_ptr<future<string>> f2 = future<string>::create_ptr()->done("x");
+		auto na = needs_all(f1, f2);
+		THEN("needs_all is done straight away") {
+			CHECK(na->is_done());
+		}
+	}
+	GIVEN("a vector where one future has already failed") {
+		auto pending = future<int>::create_shared();
+		std::vector<std::shared_ptr<future<int>>> items {
+			pending,
+			future<int>::create_shared()->fail("early")
+		};
+		auto na = needs_all(items);
+		THEN("needs_all fails without waiting for the rest") {
+			CHECK(na->is_failed());
+		}
+	}
+	GIVEN("a vector with one pending and one done") {
+		auto pending = future<int>::create_shared();
+		std::vector<std::shared_ptr<future<int>>> items {
+			pending,
+			future<int>::create_shared()->done(2)
+		};
+		auto na = needs_all(items);
+		CHECK(!na->is_ready());
+		WHEN("the pending one completes") {
+			pending->done(1);
+			THEN("needs_all is done") {
+				CHECK(na->is_done());
+			}
+		}
+	}
+	GIVEN("an empty vector") {
+		auto na = needs_all(std::vector<std::shared_ptr<future<int>>> { });
+		THEN("there's nothing to wait for") {
+			CHECK(na->is_done());
+		}
 	}
 }
 
+SCENARIO("needs_all with many inputs", "[composed][shared]") {
+	GIVEN("ten inputs of mixed types, two of them already done") {
+		vector<shared_ptr<future<int>>> ints;
+		for(int i = 0; i < 6; ++i)
+			ints.push_back(future<int>::create_shared());
+		auto s1 = future<string>::create_shared();
+		auto s2 = future<string>::create_shared();
+		std::shared_ptr<future<int>> ready1 = future<int>::create_ptr()->done(1);
+		std::shared_ptr<future<string>> ready2 = future<string>::create_ptr()->done("x");
+		auto na = needs_all(ints[0], s1, ints[1], ready1, ints[2], ints[3], s2, ready2, ints[4], ints[5]);
+		CHECK(!na->is_ready());
+		WHEN("all but one complete") {
+			for(auto &f : ints)
+				f->done(0);
+			s1->done("a");
+			THEN("needs_all is still pending") {
+				CHECK(!na->is_ready());
+			}
+			AND_WHEN("the last one completes") {
+				s2->done("b");
+				THEN("needs_all is done") {
+					CHECK(na->is_done());
+				}
+			}
+			AND_WHEN("the last one fails") {
+				s2->fail("late");
+				THEN("needs_all is failed") {
+					CHECK(na->is_failed());
+				}
+			}
+		}
+		WHEN("two of them fail") {
+			ints[2]->fail("first");
+			THEN("needs_all fails on the first") {
+				CHECK(na->is_failed());
+			}
+			AND_THEN("the second failure is ignored") {
+				CHECK_NOTHROW(s1->fail("second"));
+				CHECK_NOTHROW(ints[4]->cancel());
+				CHECK(na->is_failed());
+			}
+		}
+	}
+	GIVEN("several pending inputs and an arena") {
+		auto f1 = future<int>::create_shared();
+		auto f2 = future<int>::create_shared();
+		auto f3 = future<string>::create_shared();
+		cps::arena a;
+		future_ptr<int> na;
+		{
+			arena_scope scope { a };
+			na = needs_all(f1, f2, f3);
+		}
+		THEN("the aggregator is a single allocation") {
+			CHECK(a.live() == 1);
+		}
+		WHEN("they all complete") {
+			f1->done(1);
+			f2->done(2);
+			f3->done("3");
+			THEN("needs_all is done") {
+				CHECK(na->is_done());
+			}
+		}
+	}
+	GIVEN("a vector of pending inputs and an arena") {
+		std::vector<future_ptr<int>> items { make_future<int>(), make_future<int>() };
+		cps::arena a;
+		future_ptr<int> all;
+		future_ptr<int> any;
+		{
+			arena_scope scope { a };
+			all = needs_all(items);
+			any = needs_any(items);
+		}
+		THEN("needs_all and needs_any are a single allocation each") {
+			CHECK(a.live() == 2);
+		}
+		WHEN("they all complete") {
+			items[0]->done(1);
+			items[1]->done(2);
+			THEN("both are done") {
+				CHECK(all->is_done());
+				CHECK(any->is_done());
+			}
+		}
+	}
+}
+
+SCENARIO("needs_all and needs_any over large vectors", "[composed][shared]") {
+	GIVEN("ten thousand pending futures") {
+		vector<shared_ptr<future<int>>> items;
+		for(int i = 0; i < 10000; ++i)
+			items.push_back(future<int>::create_shared());
+		auto all = needs_all(items);
+		auto any = needs_any(items);
+		THEN("each input holds one callback per combinator, and only a pointer to the result in each") {
+			CHECK(items.front().use_count() == 1);
+			CHECK(all->use_count() == 10001);
+		}
+		WHEN("all but the last complete") {
+			for(size_t i = 0; i + 1 < items.size(); ++i)
+				items[i]->done(static_cast<int>(i));
+			THEN("needs_any is done but needs_all is not") {
+				CHECK(any->is_done());
+				CHECK(!all->is_ready());
+			}
+			AND_WHEN("the last one completes") {
+				items.back()->done(0);
+				THEN("needs_all is done") {
+					CHECK(all->is_done());
+				}
+			}
+		}
+		WHEN("one in the middle fails") {
+			items[5000]->fail("shard unavailable");
+			THEN("both fail, and later inputs change nothing") {
+				CHECK(all->is_failed());
+				CHECK(any->is_failed());
+				CHECK_NOTHROW(items[5001]->done(1));
+				CHECK_NOTHROW(items[5002]->fail("also unavailable"));
+			}
+		}
+		WHEN("both are cancelled before the inputs finish") {
+			all->cancel();
+			any->cancel();
+			THEN("the inputs can still complete or fail") {
+				CHECK_NOTHROW(items[0]->done(1));
+				CHECK_NOTHROW(items[1]->fail("shard unavailable"));
+				for(size_t i = 2; i < items.size(); ++i)
+					items[i]->done(static_cast<int>(i));
+				CHECK(all->is_cancelled());
+				CHECK(any->is_cancelled());
+			}
+		}
+	}
+}
+
+SCENARIO("gather collects values", "[composed][shared][gather]") {
+	GIVEN("a vector of futures, one of them already done") {
+		vector<shared_ptr<future<string>>> items {
+			future<string>::create_shared(),
+			future<string>::create_ptr()->done("second"),
+			future<string>::create_shared()
+		};
+		auto g = gather(items);
+		CHECK(!g->is_ready());
+		WHEN("the rest complete out of order") {
+			items[2]->done("third");
+			CHECK(!g->is_ready());
+			items[0]->done("first");
+			THEN("we get every value, in input order") {
+				REQUIRE(g->is_done());
+				CHECK((g->value() == vector<string> { "first", "second", "third" }));
+			}
+			AND_THEN("the inputs still have their values") {
+				CHECK(items[0]->value() == "first");
+			}
+		}
+		WHEN("one fails") {
+			items[2]->fail(std::out_of_range("shard 2"));
+			THEN("so do we, with the same exception") {
+				REQUIRE(g->is_failed());
+				CHECK_THROWS_AS(std::rethrow_exception(g->exception_ptr()), std::out_of_range);
+				CHECK_NOTHROW(items[0]->done("late"));
+			}
+		}
+		WHEN("one is cancelled") {
+			items[0]->cancel();
+			THEN("so are we") {
+				CHECK(g->is_cancelled());
+			}
+		}
+		WHEN("we are cancelled before the rest complete") {
+			g->cancel();
+			THEN("they can still complete or fail") {
+				CHECK_NOTHROW(items[0]->done("first"));
+				CHECK_NOTHROW(items[2]->fail("shard 2"));
+				CHECK(g->is_cancelled());
+			}
+		}
+	}
+	GIVEN("an empty vector") {
+		auto g = gather(vector<shared_ptr<future<int>>> { });
+		THEN("we're done with no values") {
+			REQUIRE(g->is_done());
+			CHECK(g->value().empty());
+		}
+	}
+	GIVEN("futures holding move-only values") {
+		vector<shared_ptr<future<unique_ptr<int>>>> items {
+			future<unique_ptr<int>>::create_shared(),
+			future<unique_ptr<int>>::create_shared()
+		};
+		auto g = gather(items);
+		WHEN("they complete") {
+			items[0]->done(unique_ptr<int>(new int(1)));
+			items[1]->done(unique_ptr<int>(new int(2)));
+			THEN("the values were moved across") {
+				REQUIRE(g->is_done());
+				auto values = g->take();
+				CHECK(*values[0] == 1);
+				CHECK(*values[1] == 2);
+			}
+		}
+	}
+	GIVEN("futures of different types") {
+		auto i = future<int>::create_shared();
+		std::shared_ptr<future<string>> s = future<string>::create_ptr()->done("ready");
+		auto d = future<double>::create_shared();
+		auto g = gather(i, s, d);
+		WHEN("they complete") {
+			d->done(2.5);
+			CHECK(!g->is_ready());
+			i->done(7);
+			THEN("we get a tuple of their values") {
+				REQUIRE(g->is_done());
+				CHECK((g->value() == make_tuple(7, string("ready"), 2.5)));
+			}
+		}
+		WHEN("one fails") {
+			i->fail("no int");
+			THEN("so do we") {
+				REQUIRE(g->is_failed());
+				CHECK(g->failure_reason() == "no int");
+			}
+		}
+		WHEN("we are cancelled before they complete") {
+			g->cancel();
+			THEN("they can still complete") {
+				CHECK_NOTHROW(d->done(2.5));
+				CHECK_NOTHROW(i->done(7));
+				CHECK(g->is_cancelled());
+			}
+		}
+	}
+}
+
+SCENARIO("needs_all_into writes into caller storage", "[composed][shared][gather]") {
+	GIVEN("pending futures and a preallocated array") {
+		vector<shared_ptr<future<int>>> items;
+		for(int i = 0; i < 4; ++i)
+			items.push_back(future<int>::create_shared());
+		vector<int> out(items.size(), -1);
+		auto na = needs_all_into(items, out.data());
+		WHEN("they complete") {
+			for(int i = 3; i >= 0; --i)
+				items[i]->done(i * 10);
+			THEN("the values are in place and the result is done") {
+				REQUIRE(na->is_done());
+				CHECK((out == vector<int> { 0, 10, 20, 30 }));
+			}
+		}
+		WHEN("one fails") {
+			items[1]->fail("nope");
+			THEN("the result fails too") {
+				CHECK(na->is_failed());
+			}
+		}
+		WHEN("the result is cancelled before they complete") {
+			na->cancel();
+			for(int i = 0; i < 4; ++i)
+				items[i]->done(i * 10);
+			THEN("the storage is left alone") {
+				CHECK(na->is_cancelled());
+				CHECK((out == vector<int> { -1, -1, -1, -1 }));
+			}
+		}
+	}
+	GIVEN("pending futures, caller storage and an arena") {
+		std::vector<future_ptr<int>> items { make_future<int>(), make_future<int>() };
+		std::vector<int> out(items.size());
+		cps::arena a;
+		future_ptr<int> na;
+		future_ptr<std::tuple<int, int>> both;
+		{
+			arena_scope scope { a };
+			na = needs_all_into(items, out.data());
+			both = gather(items[0], items[1]);
+		}
+		THEN("each result is a single allocation") {
+			CHECK(a.live() == 2);
+		}
+		WHEN("they complete") {
+			items[0]->done(1);
+			items[1]->done(2);
+			THEN("the values are where we asked for them") {
+				REQUIRE(na->is_done());
+				CHECK((out == vector<int> { 1, 2 }));
+				REQUIRE(both->is_done());
+				CHECK((both->value() == std::make_tuple(1, 2)));
+			}
+		}
+	}
+	GIVEN("an iterator into a vector, with every future already done") {
+		vector<shared_ptr<future<int>>> items;
+		for(int i = 0; i < 3; ++i)
+			items.push_back(future<int>::create_ptr()->done(i + 1));
+		vector<int> out(3);
+		auto na = needs_all_into(items, out.begin());
+		THEN("we're done straight away") {
+			REQUIRE(na->is_done());
+			CHECK((out == vector<int> { 1, 2, 3 }));
+		}
+	}
+}
+
+SCENARIO("needs_any with a future that is already ready", "[composed][shared]") {
+	GIVEN("a vector where one is done") {
+		std::vector<std::shared_ptr<future<int>>> items {
+			future<int>::create_shared(),
+			future<int>::create_shared()->done(3)
+		};
+		auto na = needs_any(items);
+		THEN("needs_any is done straight away") {
+			CHECK(na->is_done());
+		}
+	}
+}
+
+SCENARIO("needs_any with nothing to wait for", "[composed][shared]") {
+	GIVEN("no futures at all") {
+		auto na = needs_any();
+		THEN("it fails") {
+			REQUIRE(na->is_failed());
+			CHECK(na->failure_reason() == "no elements");
+		}
+	}
+	GIVEN("an empty vector") {
+		auto na = needs_any(std::vector<std::shared_ptr<future<int>>> { });
+		THEN("it fails the same way, rather than waiting forever") {
+			REQUIRE(na->is_failed());
+			CHECK(na->failure_reason() == "no elements");
+		}
+	}
+}
+
+SCENARIO("combinators take make_future results directly", "[composed][future_ptr]") {
+	GIVEN("futures from make_future") {
+		auto f1 = make_future<int>();
+		auto f2 = make_future<string>();
+		auto f3 = make_future<int>();
+		auto all = needs_all(f1, f2);
+		auto one = needs_all(f1);
+		auto any = needs_any(f1, f3);
+		auto single_any = needs_any(f2);
+		auto tuple = gather(f1, f2);
+		std::vector<future_ptr<int>> items { f1, make_future<int>()->done(2) };
+		auto all_vec = needs_all(items);
+		auto any_vec = needs_any(items);
+		auto gathered = gather(items);
+		std::vector<int> out(items.size());
+		auto into = needs_all_into(items, out.data());
+		CHECK(!all->is_ready());
+		CHECK(!tuple->is_ready());
+		CHECK(any_vec->is_done());
+		WHEN("they complete") {
+			f1->done(1);
+			f2->done("x");
+			f3->done(3);
+			THEN("every combinator sees them") {
+				CHECK(all->is_done());
+				CHECK(one->is_done());
+				CHECK(any->is_done());
+				CHECK(single_any->is_done());
+				REQUIRE(tuple->is_done());
+				CHECK((tuple->value() == std::make_tuple(1, string("x"))));
+				CHECK(all_vec->is_done());
+				REQUIRE(gathered->is_done());
+				CHECK((gathered->value() == vector<int> { 1, 2 }));
+				CHECK(into->is_done());
+				CHECK((out == vector<int> { 1, 2 }));
+			}
+		}
+	}
+	GIVEN("make_future results passed inline") {
+		auto na = needs_all(make_future<int>()->done(1), resolved_future(2));
+		THEN("they work as temporaries too") {
+			CHECK(na->is_done());
+		}
+	}
+}